@@ -0,0 +1,217 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "data_file.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef enum { SUM_ORIGINS, FOOTPRINT, BLOCK_TOTALS } Reduction;
+
+// The rows of the file a single worker streams through.
+typedef struct Worker {
+  pthread_t thread;
+  const DataFile* file;
+  Reduction reduction;
+  int origin;
+  size_t* out;
+  size_t begin;
+  size_t end;
+} Worker;
+
+int DataFileOpen(DataFile* self,
+                 const char* path,
+                 size_t bound,
+                 int dims,
+                 const size_t* blocks,
+                 size_t frame) {
+  if (dims < 1 || dims > DATA_FILE_MAX_DIM)
+    return -1;
+  self->bound = bound;
+  self->dims = dims;
+  self->ranks = 1;
+  for (int d = 0; d < dims; ++d) {
+    self->blocks[d] = blocks[d];
+    self->ranks *= blocks[d];
+  }
+  self->bytes = sizeof(size_t) * DataFileFieldCells(self) * self->ranks;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+  struct stat info;
+  if (fstat(fd, &info) || info.st_size % self->bytes ||
+      info.st_size < (frame + 1) * self->bytes) {
+    close(fd);
+    return -1;
+  }
+  self->mapped_bytes = info.st_size;
+  self->map = mmap(NULL, self->mapped_bytes, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (self->map == MAP_FAILED)
+    return -1;
+  posix_madvise(self->map, self->mapped_bytes, POSIX_MADV_SEQUENTIAL);
+  self->data = (const size_t*)self->map + frame * self->bytes / sizeof(size_t);
+  return 0;
+}
+
+void DataFileClose(DataFile* self) {
+  munmap(self->map, self->mapped_bytes);
+}
+
+int DataFileFrameTimes(const DataFile* self,
+                       const char* path,
+                       size_t frame,
+                       double* seconds) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+  size_t bytes = sizeof(double) * self->ranks;
+  ssize_t got = pread(fd, seconds, bytes, frame * bytes);
+  close(fd);
+  return got == bytes ? 0 : -1;
+}
+
+size_t DataFileFieldWidth(const DataFile* self) {
+  return self->bound * self->blocks[0];
+}
+
+size_t DataFileFieldCells(const DataFile* self) {
+  size_t cells = 1;
+  for (int d = 0; d < self->dims; ++d) {
+    cells *= self->bound * self->blocks[d];
+  }
+  return cells;
+}
+
+// Rows of the file, every one DataFileFieldWidth() cells long.
+static size_t FileRows(const DataFile* self) {
+  return DataFileFieldCells(self) / DataFileFieldWidth(self);
+}
+
+// Undo the transposition of the blocks, see |DataFile|: split the
+// file position into its coordinates, the block along axis d comes
+// from file axis dims - 1 - d and the cell inside it from axis d.
+// Stores the field cell index in |cell| and the rank of the block
+// in |block|.
+static void Locate(const DataFile* self,
+                   size_t row,
+                   size_t column,
+                   size_t* cell,
+                   size_t* block) {
+  size_t file[DATA_FILE_MAX_DIM];
+  int last = self->dims - 1;
+  file[last] = column;
+  for (int k = last - 1; k >= 0; --k) {
+    size_t length = self->bound * self->blocks[last - k];
+    file[k] = row % length;
+    row /= length;
+  }
+  size_t cell_stride = 1;
+  size_t block_stride = 1;
+  *cell = 0;
+  *block = 0;
+  for (int d = 0; d < self->dims; ++d) {
+    size_t block_pos = file[last - d] / self->bound;
+    *cell += (block_pos * self->bound + file[d] % self->bound) * cell_stride;
+    *block += block_pos * block_stride;
+    cell_stride *= self->bound * self->blocks[d];
+    block_stride *= self->blocks[d];
+  }
+}
+
+static void* WorkerJob(void* in) {
+  Worker* worker = (Worker*)in;
+  const DataFile* file = worker->file;
+  size_t columns = DataFileFieldWidth(file);
+  for (size_t row = worker->begin; row < worker->end; ++row) {
+    const size_t* cell = file->data + row * columns * file->ranks;
+    for (size_t column = 0; column < columns; ++column) {
+      size_t index;
+      size_t block;
+      Locate(file, row, column, &index, &block);
+      switch (worker->reduction) {
+        case SUM_ORIGINS: {
+          size_t sum = 0;
+          for (size_t origin = 0; origin < file->ranks; ++origin) {
+            sum += cell[origin];
+          }
+          worker->out[index] = sum;
+          break;
+        }
+        case FOOTPRINT: {
+          worker->out[index] = cell[worker->origin];
+          break;
+        }
+        case BLOCK_TOTALS: {
+          for (size_t origin = 0; origin < file->ranks; ++origin) {
+            worker->out[origin * file->ranks + block] += cell[origin];
+          }
+          break;
+        }
+      }
+      cell += file->ranks;
+    }
+  }
+  return NULL;
+}
+
+// Split the rows of the file between |threads| workers. Every
+// worker writes a disjoint part of |out|, except for the block
+// totals that are accumulated per worker and merged at the end.
+static void RunReduction(const DataFile* self,
+                         Reduction reduction,
+                         int origin,
+                         size_t* out,
+                         size_t out_length,
+                         int threads) {
+  size_t rows = FileRows(self);
+  if (threads < 1)
+    threads = 1;
+  if (threads > rows)
+    threads = rows;
+  Worker* workers = (Worker*)malloc(sizeof(Worker) * threads);
+  memset(out, 0, sizeof(size_t) * out_length);
+  for (int i = 0; i < threads; ++i) {
+    workers[i].file = self;
+    workers[i].reduction = reduction;
+    workers[i].origin = origin;
+    workers[i].out = out;
+    if (reduction == BLOCK_TOTALS)
+      workers[i].out = (size_t*)calloc(out_length, sizeof(size_t));
+    workers[i].begin = rows * i / threads;
+    workers[i].end = rows * (i + 1) / threads;
+    pthread_create(&workers[i].thread, NULL, WorkerJob, workers + i);
+  }
+  for (int i = 0; i < threads; ++i) {
+    pthread_join(workers[i].thread, NULL);
+    if (reduction == BLOCK_TOTALS) {
+      for (size_t j = 0; j < out_length; ++j) {
+        out[j] += workers[i].out[j];
+      }
+      free(workers[i].out);
+    }
+  }
+  free(workers);
+}
+
+void DataFileSumOrigins(const DataFile* self, size_t* out, int threads) {
+  RunReduction(self, SUM_ORIGINS, 0, out,
+               DataFileFieldCells(self), threads);
+}
+
+void DataFileFootprint(const DataFile* self,
+                       int origin,
+                       size_t* out,
+                       int threads) {
+  RunReduction(self, FOOTPRINT, origin, out,
+               DataFileFieldCells(self), threads);
+}
+
+void DataFileBlockTotals(const DataFile* self, size_t* out, int threads) {
+  RunReduction(self, BLOCK_TOTALS, 0, out, self->ranks * self->ranks,
+               threads);
+}
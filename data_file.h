@@ -0,0 +1,74 @@
+#include <stddef.h>
+
+#pragma once
+
+#define DATA_FILE_MAX_DIM 3
+
+// Read-only view of a data.bin written by the simulation.
+//
+// Every cell of the file holds one counter per origin rank. In 2D
+// the file holds bound * height rows of bound * width cells, and
+// rank (x_pos, y_pos) writes its block transposed: file row
+// y_pos * bound + x and column x_pos * bound + y hold its local cell
+// (x, y). In 3D the blocks are laid out [z_pos][y_pos][x_pos] in the
+// same way, with the local cells of each block in [x][y][z] order.
+typedef struct DataFile {
+  const size_t* data;
+  // Bytes of a single field, and the whole mapping.
+  size_t bytes;
+  void* map;
+  size_t mapped_bytes;
+  size_t bound;
+  int dims;
+  size_t blocks[DATA_FILE_MAX_DIM];
+  size_t ranks;
+} DataFile;
+
+// Map |path| into memory as a field of |dims| dimensions with
+// |blocks| blocks along every axis. A snapshots.bin holds one such
+// field per snapshot, |frame| selects which one; it is 0 for a
+// data.bin. Returns 0 on success, -1 if the file cannot be mapped or
+// its size does not match the field.
+//
+// Every rank copies its counters for a frame on its own clock, and a
+// rank that is done puts its final counters into every later frame,
+// so the blocks of a frame need not be from the same moment. Next to
+// snapshots.bin, snapshot_times.bin tells how far apart they are: it
+// holds a double per rank per frame, indexed [frame][rank], with the
+// seconds since the start of the run at which the rank handed its
+// copy over. The start is taken by every rank after a barrier. A done
+// rank repeats the time of its final counters.
+int DataFileOpen(DataFile* self,
+                 const char* path,
+                 size_t bound,
+                 int dims,
+                 const size_t* blocks,
+                 size_t frame);
+
+void DataFileClose(DataFile* self);
+
+// Read the times of |frame| of a snapshot_times.bin at |path| into
+// |seconds|, one per rank of |self|. Returns 0 on success, -1 if the
+// file has no such frame.
+int DataFileFrameTimes(const DataFile* self,
+                       const char* path,
+                       size_t frame,
+                       double* seconds);
+
+// Cells of the field along x, and in total.
+size_t DataFileFieldWidth(const DataFile* self);
+
+size_t DataFileFieldCells(const DataFile* self);
+
+// Sum over all origins. |out| holds one counter per field cell,
+// indexed [z][y][x].
+void DataFileSumOrigins(const DataFile* self, size_t* out, int threads);
+
+// Counters of a single |origin| rank, indexed [z][y][x].
+void DataFileFootprint(const DataFile* self,
+                       int origin,
+                       size_t* out,
+                       int threads);
+
+// Particles that finished in every block, indexed [origin][block].
+void DataFileBlockTotals(const DataFile* self, size_t* out, int threads);
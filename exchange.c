@@ -0,0 +1,79 @@
+#include "exchange.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const size_t kInitialCapacity = 16;
+
+void ExchangeInit(Exchange* self, const int* neighbors, int neighbor_count) {
+  self->neighbor_count = neighbor_count;
+  self->neighbors = (int*)malloc(sizeof(int) * neighbor_count);
+  memcpy(self->neighbors, neighbors, sizeof(int) * neighbor_count);
+  self->send = (Particle**)malloc(sizeof(Particle*) * neighbor_count);
+  self->send_counts = (size_t*)calloc(neighbor_count, sizeof(size_t));
+  self->send_capacities = (size_t*)malloc(sizeof(size_t) * neighbor_count);
+  self->receive = (Particle**)calloc(neighbor_count, sizeof(Particle*));
+  self->receive_counts = (size_t*)calloc(neighbor_count, sizeof(size_t));
+  for (int i = 0; i < neighbor_count; ++i) {
+    self->send[i] = (Particle*)malloc(sizeof(Particle) * kInitialCapacity);
+    self->send_capacities[i] = kInitialCapacity;
+  }
+  self->finished = 0;
+  self->done = 0;
+  pthread_mutex_init(&self->mtx, NULL);
+  pthread_cond_init(&self->cond, NULL);
+}
+
+void ExchangeDestroy(Exchange* self) {
+  ExchangeClear(self);
+  for (int i = 0; i < self->neighbor_count; ++i) {
+    free(self->send[i]);
+  }
+  free(self->neighbors);
+  free(self->send);
+  free(self->send_counts);
+  free(self->send_capacities);
+  free(self->receive);
+  free(self->receive_counts);
+  pthread_mutex_destroy(&self->mtx);
+  pthread_cond_destroy(&self->cond);
+}
+
+void ExchangeClear(Exchange* self) {
+  for (int i = 0; i < self->neighbor_count; ++i) {
+    free(self->receive[i]);
+    self->receive[i] = NULL;
+    self->receive_counts[i] = 0;
+    self->send_counts[i] = 0;
+  }
+  self->finished = 0;
+  self->done = 0;
+}
+
+void ExchangeAdd(Exchange* self, int target, const Particle* particle) {
+  int i = 0;
+  while (i < self->neighbor_count && self->neighbors[i] != target)
+    ++i;
+  assert(i < self->neighbor_count);
+  if (self->send_counts[i] == self->send_capacities[i]) {
+    self->send_capacities[i] *= 2;
+    self->send[i] = (Particle*)realloc(
+        self->send[i], sizeof(Particle) * self->send_capacities[i]);
+  }
+  self->send[i][self->send_counts[i]++] = *particle;
+}
+
+void ExchangeComplete(Exchange* self) {
+  pthread_mutex_lock(&self->mtx);
+  self->done = 1;
+  pthread_cond_signal(&self->cond);
+  pthread_mutex_unlock(&self->mtx);
+}
+
+void ExchangeWait(Exchange* self) {
+  pthread_mutex_lock(&self->mtx);
+  while (!self->done)
+    pthread_cond_wait(&self->cond, &self->mtx);
+  pthread_mutex_unlock(&self->mtx);
+}
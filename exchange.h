@@ -0,0 +1,44 @@
+#include <pthread.h>
+#include <stddef.h>
+
+#include "simulation.h"
+
+#pragma once
+
+// Particles swapped with the neighboring ranks at the end of
+// a lockstep superstep.
+typedef struct Exchange {
+  int neighbor_count;
+  int* neighbors;
+  // Outgoing particles for every neighbor, stored by value.
+  Particle** send;
+  size_t* send_counts;
+  size_t* send_capacities;
+  // Incoming particles from every neighbor, allocated by the
+  // messenger thread and released by |ExchangeClear|.
+  Particle** receive;
+  size_t* receive_counts;
+  // Particles that finished on this rank when the exchange is
+  // started, on all ranks once it is done.
+  size_t finished;
+  int done;
+  pthread_mutex_t mtx;
+  pthread_cond_t cond;
+} Exchange;
+
+// Create an exchange with |neighbor_count| distinct |neighbors|.
+void ExchangeInit(Exchange* self, const int* neighbors, int neighbor_count);
+
+void ExchangeDestroy(Exchange* self);
+
+// Drop the particles of the previous superstep.
+void ExchangeClear(Exchange* self);
+
+// Queue a copy of |particle| for the neighbor with rank |target|.
+void ExchangeAdd(Exchange* self, int target, const Particle* particle);
+
+// Mark the exchange as complete and wake up |ExchangeWait|.
+void ExchangeComplete(Exchange* self);
+
+// Block until the messenger thread completes the exchange.
+void ExchangeWait(Exchange* self);
@@ -8,11 +8,20 @@ struct FixedList {
   FixedListNode* pool_;
   size_t pool_size_;
   size_t size_;
+  int owns_pool_;
 };
 
 FixedList* FixedListCreate(size_t size) {
+  FixedList* self = FixedListCreateInPool(
+      size, (FixedListNode*)malloc(size * sizeof(FixedList)));
+  self->owns_pool_ = 1;
+  return self;
+}
+
+FixedList* FixedListCreateInPool(size_t size, FixedListNode* pool) {
   FixedList* self = (FixedList*)malloc(sizeof(FixedList));
-  self->pool_ = (FixedListNode*)malloc(size * sizeof(FixedList));
+  self->pool_ = pool;
+  self->owns_pool_ = 0;
   for (size_t i = 0; i < size - 1; ++i) {
     self->pool_[i].next = self->pool_ + i + 1;
   }
@@ -25,7 +34,8 @@ FixedList* FixedListCreate(size_t size) {
 }
 
 void FixedListDelete(FixedList* self) {
-  free(self->pool_);
+  if (self->owns_pool_)
+    free(self->pool_);
   free(self);
 }
 
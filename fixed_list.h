@@ -14,6 +14,10 @@ typedef struct FixedList FixedList;
 // Create a fixed list of |size| elements.
 FixedList* FixedListCreate(size_t size);
 
+// Create a fixed list of |size| elements on top of |pool|, which
+// must hold |size| nodes and outlive the list.
+FixedList* FixedListCreateInPool(size_t size, FixedListNode* pool);
+
 void FixedListDelete(FixedList* self);
 
 // Push |data| into the list. The list does not assume
@@ -0,0 +1,20 @@
+#include "lattice.h"
+
+#if WALK_DIM == 2 && !WALK_DIAGONAL
+const int kLatticeOffsets[WALK_DIRECTIONS][WALK_DIM] = {
+    {-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+#elif WALK_DIM == 2
+const int kLatticeOffsets[WALK_DIRECTIONS][WALK_DIM] = {
+    {-1, -1}, {0, -1}, {1, -1}, {-1, 0}, {1, 0}, {-1, 1}, {0, 1}, {1, 1}};
+#elif !WALK_DIAGONAL
+const int kLatticeOffsets[WALK_DIRECTIONS][WALK_DIM] = {
+    {-1, 0, 0}, {1, 0, 0}, {0, -1, 0}, {0, 1, 0}, {0, 0, -1}, {0, 0, 1}};
+#else
+const int kLatticeOffsets[WALK_DIRECTIONS][WALK_DIM] = {
+    {-1, -1, -1}, {0, -1, -1}, {1, -1, -1}, {-1, 0, -1}, {0, 0, -1},
+    {1, 0, -1},   {-1, 1, -1}, {0, 1, -1},  {1, 1, -1},  {-1, -1, 0},
+    {0, -1, 0},   {1, -1, 0},  {-1, 0, 0},  {1, 0, 0},   {-1, 1, 0},
+    {0, 1, 0},    {1, 1, 0},   {-1, -1, 1}, {0, -1, 1},  {1, -1, 1},
+    {-1, 0, 1},   {0, 0, 1},   {1, 0, 1},   {-1, 1, 1},  {0, 1, 1},
+    {1, 1, 1}};
+#endif
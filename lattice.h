@@ -0,0 +1,35 @@
+#pragma once
+
+// Shape of the walk, fixed at compile time so that every loop over
+// the coordinates or the directions has a constant trip count and
+// the stepping kernel is unrolled without any branches.
+//
+// WALK_DIM is the number of dimensions, 2 or 3. Without
+// WALK_DIAGONAL a particle moves along a single axis per step,
+// otherwise it may move to any of the surrounding cells.
+#ifndef WALK_DIM
+#define WALK_DIM 2
+#endif
+
+#ifndef WALK_DIAGONAL
+#define WALK_DIAGONAL 0
+#endif
+
+#if WALK_DIM != 2 && WALK_DIM != 3
+#error "WALK_DIM must be 2 or 3"
+#endif
+
+// Cells around a cell, and blocks around a block.
+#define WALK_NEIGHBORS (WALK_DIM == 2 ? 8 : 26)
+
+#if WALK_DIAGONAL
+#define WALK_DIRECTIONS WALK_NEIGHBORS
+#else
+#define WALK_DIRECTIONS (2 * WALK_DIM)
+#endif
+
+// Move of every direction. Without diagonals the directions go axis
+// by axis, negative first: left, right, up, down, then back and
+// forward in 3D. With diagonals they go over the surrounding cells
+// with x changing fastest.
+extern const int kLatticeOffsets[WALK_DIRECTIONS][WALK_DIM];
@@ -0,0 +1,24 @@
+#include "mailbox.h"
+
+void MailboxInit(Mailbox* self) {
+  self->head = 0;
+  self->tail = 0;
+}
+
+int MailboxPut(Mailbox* self, const Particle* particle) {
+  size_t tail = self->tail;
+  if (tail - __atomic_load_n(&self->head, __ATOMIC_ACQUIRE) == MAILBOX_SLOTS)
+    return 0;
+  self->slots[tail % MAILBOX_SLOTS] = *particle;
+  __atomic_store_n(&self->tail, tail + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+int MailboxTake(Mailbox* self, Particle* particle) {
+  size_t head = self->head;
+  if (head == __atomic_load_n(&self->tail, __ATOMIC_ACQUIRE))
+    return 0;
+  *particle = self->slots[head % MAILBOX_SLOTS];
+  __atomic_store_n(&self->head, head + 1, __ATOMIC_RELEASE);
+  return 1;
+}
@@ -0,0 +1,33 @@
+#include <stddef.h>
+
+#include "simulation.h"
+
+#pragma once
+
+#define MAILBOX_SLOTS 256
+#define MAILBOX_LINE 64
+
+// Ring of particles from one rank to another on the same node,
+// placed in memory shared between the two processes. It has a
+// single producer, the compute thread of the sender, and a single
+// consumer, the compute thread of the receiver, so the two indices
+// are enough to synchronize them without locks. They sit on
+// separate cache lines to keep the two sides from false sharing.
+typedef struct Mailbox {
+  // Next slot to read, only written by the consumer.
+  size_t head;
+  char head_padding[MAILBOX_LINE - sizeof(size_t)];
+  // Next slot to write, only written by the producer.
+  size_t tail;
+  char tail_padding[MAILBOX_LINE - sizeof(size_t)];
+  Particle slots[MAILBOX_SLOTS];
+} Mailbox;
+
+void MailboxInit(Mailbox* self);
+
+// Copy |particle| into the ring. Returns 0 if it is full.
+int MailboxPut(Mailbox* self, const Particle* particle);
+
+// Move the oldest particle of the ring into |particle|. Returns 0
+// if it is empty.
+int MailboxTake(Mailbox* self, Particle* particle);
@@ -1,32 +1,94 @@
 #include <assert.h>
 #include <mpi.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "simulation.h"
 
+// Positional arguments: bound, the blocks along every axis, the
+// number of steps and particles per block, and a probability per
+// direction of |kLatticeOffsets|.
+#define POSITIONAL_ARGS (1 + WALK_DIM + 2 + WALK_DIRECTIONS)
+
+// Parse the optional name=value arguments that follow the
+// positional ones.
+void ParseOptions(int argc, char* argv[], SimulationOptions* options) {
+  for (int i = POSITIONAL_ARGS + 1; i < argc; ++i) {
+    if (sscanf(argv[i], "dump=%d", &options->dump_field) == 1)
+      continue;
+    if (sscanf(argv[i], "summary=%d", &options->write_summary) == 1)
+      continue;
+    if (sscanf(argv[i], "lockstep=%lu", &options->lockstep_steps) == 1)
+      continue;
+    if (sscanf(argv[i], "legacy=%d", &options->legacy_kernel) == 1)
+      continue;
+    if (sscanf(argv[i], "seed=%u", &options->seed) == 1)
+      continue;
+    if (sscanf(argv[i], "report=%d", &options->report) == 1)
+      continue;
+    if (!strcmp(argv[i], "pin=none")) {
+      options->pin = PIN_NONE;
+      continue;
+    }
+    if (!strcmp(argv[i], "pin=cores")) {
+      options->pin = PIN_CORES;
+      continue;
+    }
+    if (!strcmp(argv[i], "pin=smt")) {
+      options->pin = PIN_SMT;
+      continue;
+    }
+    if (sscanf(argv[i], "core_offset=%d", &options->core_offset) == 1)
+      continue;
+    if (sscanf(argv[i], "snapshot=%lf", &options->snapshot_seconds) == 1)
+      continue;
+    if (sscanf(argv[i], "mailbox=%d", &options->mailboxes) == 1)
+      continue;
+    if (sscanf(argv[i], "trace=%lf", &options->trace_rate) == 1)
+      continue;
+    if (!strncmp(argv[i], "output=", strlen("output="))) {
+      options->output_dir = argv[i] + strlen("output=");
+      continue;
+    }
+    if (!strcmp(argv[i], "pages=default")) {
+      options->pages = PAGES_DEFAULT;
+      continue;
+    }
+    if (!strcmp(argv[i], "pages=transparent")) {
+      options->pages = PAGES_TRANSPARENT;
+      continue;
+    }
+    if (!strcmp(argv[i], "pages=explicit")) {
+      options->pages = PAGES_EXPLICIT;
+      continue;
+    }
+    fprintf(stderr, "Unknown option: %s\n", argv[i]);
+    MPI_Abort(MPI_COMM_WORLD, 1);
+  }
+}
+
 int main(int argc, char* argv[]) {
   int support;
   MPI_Init_thread(&argc, &argv, MPI_THREAD_SERIALIZED, &support);
   size_t l;
-  size_t a;
-  size_t b;
+  size_t blocks[WALK_DIM];
   size_t n;
   size_t N;
-  double p_l;
-  double p_r;
-  double p_u;
-  double p_d;
-  assert(argc == 10);
+  double probabilities[WALK_DIRECTIONS];
+  SimulationOptions options;
+  assert(argc >= POSITIONAL_ARGS + 1);
   assert(sscanf(argv[1], "%lu", &l));
-  assert(sscanf(argv[2], "%lu", &a));
-  assert(sscanf(argv[3], "%lu", &b));
-  assert(sscanf(argv[4], "%lu", &n));
-  assert(sscanf(argv[5], "%lu", &N));
-  assert(sscanf(argv[6], "%lf", &p_l));
-  assert(sscanf(argv[7], "%lf", &p_r));
-  assert(sscanf(argv[8], "%lf", &p_u));
-  assert(sscanf(argv[9], "%lf", &p_d));
-  SimulationRun(l, a, b, n, N, p_l, p_r, p_u, p_d);
+  for (int d = 0; d < WALK_DIM; ++d) {
+    assert(sscanf(argv[2 + d], "%lu", blocks + d));
+  }
+  assert(sscanf(argv[2 + WALK_DIM], "%lu", &n));
+  assert(sscanf(argv[3 + WALK_DIM], "%lu", &N));
+  for (int i = 0; i < WALK_DIRECTIONS; ++i) {
+    assert(sscanf(argv[4 + WALK_DIM + i], "%lf", probabilities + i));
+  }
+  SimulationOptionsInit(&options);
+  ParseOptions(argc, argv, &options);
+  SimulationRun(l, blocks, n, N, probabilities, &options);
   MPI_Finalize();
 }
@@ -1,17 +1,49 @@
 #include "messenger_thread.h"
 
+#include <assert.h>
+#include <errno.h>
 #include <mpi.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 
 #include "atomic.h"
+#include "exchange.h"
+#include "mailbox.h"
 #include "queue.h"
 
 static MPI_Datatype MPI_Particle;
-static MPI_Datatype MPI_Particle_Vector;
+static MPI_Datatype MPI_Trace_Event;
+// The part of data.bin written by this rank.
+static MPI_Datatype MPI_Field_Block;
 
 static const char* kDumpFilename = "data.bin";
+static const char* kSnapshotFilename = "snapshots.bin";
+static const char* kSnapshotTimesFilename = "snapshot_times.bin";
+static const char* kSummaryFilename = "summary.txt";
+static const char* kTraceFilename = "trace.bin";
+static const char kAxisNames[] = "xyz";
+
+typedef enum {
+  PARTICLE,
+  COUNT,
+  DUMP,
+  SUMMARY,
+  REPORT,
+  EXCHANGE,
+  EXCHANGE_COUNT,
+  EXCHANGE_DATA,
+  SNAPSHOT
+} MessengerThreadMessageId;
+
+typedef enum {
+  SNAPSHOT_IDLE,
+  // Agreeing whether every rank is done.
+  SNAPSHOT_VOTE,
+  SNAPSHOT_WRITE
+} SnapshotStage;
 
 struct MessengerThread {
   pthread_t thread_;
@@ -19,10 +51,57 @@ struct MessengerThread {
   pthread_mutex_t send_queue_mtx_;
   Queue receive_queue_;
   pthread_mutex_t receive_queue_mtx_;
+  // Sends that are still in flight, only touched by the thread.
+  Queue pending_sends_;
+  // Lockstep exchange in flight, only touched by the thread.
+  Exchange* exchange_;
+  MPI_Request* exchange_requests_;
+  int exchange_request_count_;
+  MessengerThreadMessageId exchange_stage_;
+  // Snapshots and the final dump waiting to be written, and the one
+  // being written, only touched by the thread. See SnapshotProgress.
+  Queue snapshots_;
+  struct OutgoingMessage* snapshot_;
+  SnapshotStage snapshot_stage_;
+  MPI_Request snapshot_request_;
+  int snapshot_final_;
+  int snapshot_all_final_;
+  MPI_Offset snapshot_frame_;
+  // Collectives of the snapshots run on their own communicator, so
+  // that they never have to line up with the other ones.
+  MPI_Comm snapshot_comm_;
+  MPI_File snapshot_file_;
+  // When every rank copied the counters of every frame, see
+  // data_file.h.
+  MPI_File snapshot_times_file_;
+  MPI_Request snapshot_time_request_;
+  MPI_File dump_file_;
+  atomic_size_t snapshot_busy_;
+  int write_snapshots_;
+  const char* output_dir_;
+  // Events of the traced particles and the ones being appended to
+  // |trace_file_|, NULL if nothing is traced.
+  TraceBuffer* trace_;
+  TraceEvent* trace_flush_;
+  MPI_File trace_file_;
+  MPI_Request trace_request_;
   atomic_size_t finished_count_;
   atomic_size_t shutdown_;
+  // Ranks that share the node with this one.
+  MPI_Comm node_comm_;
+  // Shared-memory window with a mailbox from every rank of the node
+  // to this one. The mailboxes are only touched by the compute
+  // threads, |outboxes_| holds the one to every world rank on the
+  // node and NULL for the others.
+  MPI_Win mailbox_win_;
+  Mailbox* inboxes_;
+  int inbox_count_;
+  int next_inbox_;
+  Mailbox** outboxes_;
+  int use_mailboxes_;
+  double start_time_;
   size_t bound;
-  size_t width;
+  size_t blocks[WALK_DIM];
   int rank;
   int size;
 };
@@ -32,8 +111,6 @@ typedef struct MessengerThreadParams {
   MessengerThread* self;
 } MessengerThreadParams;
 
-typedef enum { PARTICLE, COUNT, DUMP } MessengerThreadMessageId;
-
 typedef struct OutgoingMessage {
   MessengerThreadMessageId type;
   union {
@@ -45,13 +122,26 @@ typedef struct OutgoingMessage {
     struct {
       size_t* counts;
       size_t length;
+      // When the counters were handed over, since the run started.
+      double seconds;
     } dump;
+    Statistics* summary;
+    RunReport* report;
+    Exchange* exchange;
   } value;
 } OutgoingMessage;
 
-void InitializeStructure(InitialParams* params) {
+// A non-blocking send together with the buffer it reads from,
+// which can only be freed once the send completes.
+typedef struct PendingSend {
+  MPI_Request request;
+  void* buffer;
+} PendingSend;
+
+void InitializeStructure(MessengerThread* self, InitialParams* params) {
   pthread_mutex_lock(&params->mtx);
   MPI_Comm_rank(MPI_COMM_WORLD, &params->rank);
+  MPI_Comm_rank(self->node_comm_, &params->local_rank);
   pthread_mutex_unlock(&params->mtx);
   atomic_store(&params->done, 1);
   pthread_cond_signal(&params->cond);
@@ -67,25 +157,334 @@ OutgoingMessage* PopMessage(MessengerThread* self) {
   return to_return;
 }
 
-void DumpData(MessengerThread* self, OutgoingMessage* msg) {
-  MPI_File file;
-  MPI_Aint inset;
-  MPI_Aint unused;
-  MPI_Type_get_extent(MPI_UNSIGNED_LONG_LONG, &unused, &inset);
-  MPI_File_open(MPI_COMM_WORLD, kDumpFilename, MPI_MODE_CREATE | MPI_MODE_RDWR,
-                MPI_INFO_NULL, &file);
-  size_t x_pos = self->rank % self->width;
-  size_t y_pos = self->rank / self->width;
+void OutputPath(MessengerThread* self,
+                const char* name,
+                char* path,
+                size_t size) {
+  snprintf(path, size, "%s/%s", self->output_dir_, name);
+}
+
+// Create the output directory and open the snapshot and trace
+// files on every rank, before anything else may block them.
+void OpenOutput(MessengerThread* self) {
+  MPI_Comm_dup(MPI_COMM_WORLD, &self->snapshot_comm_);
+  if (self->rank == 0 && mkdir(self->output_dir_, 0777) && errno != EEXIST)
+    fprintf(stderr, "Cannot create %s\n", self->output_dir_);
+  MPI_Barrier(self->snapshot_comm_);
+  char path[FILENAME_MAX];
+  self->trace_file_ = MPI_FILE_NULL;
+  self->trace_request_ = MPI_REQUEST_NULL;
+  if (self->trace_) {
+    OutputPath(self, kTraceFilename, path, sizeof(path));
+    MPI_File_open(self->snapshot_comm_, path,
+                  MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL,
+                  &self->trace_file_);
+    MPI_File_set_size(self->trace_file_, 0);
+  }
+  self->snapshot_file_ = MPI_FILE_NULL;
+  self->snapshot_times_file_ = MPI_FILE_NULL;
+  self->snapshot_time_request_ = MPI_REQUEST_NULL;
+  if (!self->write_snapshots_)
+    return;
+  OutputPath(self, kSnapshotTimesFilename, path, sizeof(path));
+  MPI_File_open(self->snapshot_comm_, path, MPI_MODE_CREATE | MPI_MODE_WRONLY,
+                MPI_INFO_NULL, &self->snapshot_times_file_);
+  MPI_File_set_size(self->snapshot_times_file_, 0);
+  OutputPath(self, kSnapshotFilename, path, sizeof(path));
+  MPI_File_open(self->snapshot_comm_, path, MPI_MODE_CREATE | MPI_MODE_WRONLY,
+                MPI_INFO_NULL, &self->snapshot_file_);
+  MPI_File_set_size(self->snapshot_file_, 0);
+  MPI_File_set_view(self->snapshot_file_, 0, MPI_UNSIGNED_LONG_LONG,
+                    MPI_Field_Block, "native", MPI_INFO_NULL);
+}
+
+// Once every rank has voted, start writing the counters: into
+// data.bin if all of them are done, otherwise as the next frame
+// of the snapshot file along with the time they were taken.
+void SnapshotWrite(MessengerThread* self) {
+  size_t* counts = self->snapshot_->value.dump.counts;
+  size_t length = self->snapshot_->value.dump.length;
+  if (!self->snapshot_all_final_) {
+    MPI_File_iwrite_at_all(self->snapshot_file_, self->snapshot_frame_ * length,
+                           counts, length, MPI_UNSIGNED_LONG_LONG,
+                           &self->snapshot_request_);
+    MPI_File_iwrite_at(self->snapshot_times_file_,
+                       (self->snapshot_frame_ * self->size + self->rank) *
+                           sizeof(double),
+                       &self->snapshot_->value.dump.seconds, 1, MPI_DOUBLE,
+                       &self->snapshot_time_request_);
+    return;
+  }
+  char path[FILENAME_MAX];
+  OutputPath(self, kDumpFilename, path, sizeof(path));
+  MPI_File_open(self->snapshot_comm_, path, MPI_MODE_CREATE | MPI_MODE_WRONLY,
+                MPI_INFO_NULL, &self->dump_file_);
+  MPI_File_set_size(self->dump_file_, 0);
+  MPI_File_set_view(self->dump_file_, 0, MPI_UNSIGNED_LONG_LONG,
+                    MPI_Field_Block, "native", MPI_INFO_NULL);
+  MPI_File_iwrite_all(self->dump_file_, counts, length, MPI_UNSIGNED_LONG_LONG,
+                      &self->snapshot_request_);
+}
+
+void SnapshotFinish(MessengerThread* self) {
+  if (self->snapshot_all_final_) {
+    MPI_File_close(&self->dump_file_);
+    if (self->snapshot_file_ != MPI_FILE_NULL) {
+      MPI_File_close(&self->snapshot_file_);
+      MPI_File_close(&self->snapshot_times_file_);
+    }
+    free(self->snapshot_);
+  } else if (self->snapshot_final_) {
+    // This rank is done but some are not, it keeps voting with
+    // its final counters until they are.
+    QueuePush(&self->snapshots_, self->snapshot_);
+  } else {
+    free(self->snapshot_);
+    atomic_store(&self->snapshot_busy_, 0);
+  }
+  ++self->snapshot_frame_;
+  self->snapshot_ = NULL;
+}
+
+// Snapshots go in rounds, one at a time. Every rank joins a round
+// with its next snapshot or its final counters, and the round is
+// written once all of them have joined, without blocking the
+// thread. The round in which every rank is done writes data.bin.
+void SnapshotProgress(MessengerThread* self) {
+  int done = 0;
+  switch (self->snapshot_stage_) {
+    case SNAPSHOT_IDLE: {
+      if (QueueEmpty(&self->snapshots_))
+        return;
+      self->snapshot_ = (OutgoingMessage*)QueuePop(&self->snapshots_);
+      self->snapshot_final_ = self->snapshot_->type == DUMP;
+      MPI_Iallreduce(&self->snapshot_final_, &self->snapshot_all_final_, 1,
+                     MPI_INT, MPI_MIN, self->snapshot_comm_,
+                     &self->snapshot_request_);
+      self->snapshot_stage_ = SNAPSHOT_VOTE;
+      break;
+    }
+    case SNAPSHOT_VOTE: {
+      MPI_Test(&self->snapshot_request_, &done, MPI_STATUS_IGNORE);
+      if (!done)
+        return;
+      SnapshotWrite(self);
+      self->snapshot_stage_ = SNAPSHOT_WRITE;
+      break;
+    }
+    case SNAPSHOT_WRITE: {
+      MPI_Test(&self->snapshot_request_, &done, MPI_STATUS_IGNORE);
+      if (!done)
+        return;
+      MPI_Test(&self->snapshot_time_request_, &done, MPI_STATUS_IGNORE);
+      if (!done)
+        return;
+      SnapshotFinish(self);
+      self->snapshot_stage_ = SNAPSHOT_IDLE;
+      break;
+    }
+  }
+}
+
+void DumpSummary(MessengerThread* self, OutgoingMessage* msg) {
+  Statistics* stats = msg->value.summary;
+  size_t cells = 1;
+  for (int d = 0; d < WALK_DIM; ++d) {
+    cells *= self->bound;
+  }
+  Moments* all_moments = NULL;
+  size_t* all_origins = NULL;
+  size_t* all_cells = NULL;
+  if (self->rank == 0) {
+    all_moments = (Moments*)malloc(sizeof(Moments) * self->size);
+    all_origins = (size_t*)malloc(sizeof(size_t) * self->size * self->size);
+    all_cells = (size_t*)malloc(sizeof(size_t) * self->size * cells);
+  }
+  MPI_Gather(&stats->displacement, MOMENTS_FIELDS, MPI_DOUBLE, all_moments,
+             MOMENTS_FIELDS, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+  MPI_Gather(stats->origins, self->size, MPI_UNSIGNED_LONG_LONG, all_origins,
+             self->size, MPI_UNSIGNED_LONG_LONG, 0, MPI_COMM_WORLD);
+  MPI_Gather(stats->cells, cells, MPI_UNSIGNED_LONG_LONG, all_cells, cells,
+             MPI_UNSIGNED_LONG_LONG, 0, MPI_COMM_WORLD);
+  if (self->rank != 0)
+    return;
+
+  Moments total;
+  MomentsInit(&total);
+  for (int i = 0; i < self->size; ++i) {
+    MomentsMerge(&total, all_moments + i);
+  }
+  char path[FILENAME_MAX];
+  OutputPath(self, kSummaryFilename, path, sizeof(path));
+  FILE* file = fopen(path, "w");
+  assert(file);
+  fprintf(file, "particles %.0f\n", total.count);
+  for (int i = 0; i < WALK_DIM; ++i) {
+    fprintf(file, "mean_d%c %.17g\n", kAxisNames[i], total.mean[i]);
+  }
+  for (int i = 0; i < WALK_DIM; ++i) {
+    fprintf(file, "var_d%c %.17g\n", kAxisNames[i],
+            MomentsCovariance(&total, i, i));
+  }
+  for (int i = 0; i < WALK_DIM; ++i) {
+    for (int j = i + 1; j < WALK_DIM; ++j) {
+      fprintf(file, "cov_d%cd%c %.17g\n", kAxisNames[i], kAxisNames[j],
+              MomentsCovariance(&total, i, j));
+    }
+  }
+  fprintf(file, "msd %.17g\n", total.mean_r2);
+  // One row per origin rank, one column per destination block.
+  fprintf(file, "transfer %d %d\n", self->size, self->size);
+  for (int origin = 0; origin < self->size; ++origin) {
+    for (int dest = 0; dest < self->size; ++dest) {
+      fprintf(file, dest ? " %lu" : "%lu",
+              all_origins[dest * self->size + origin]);
+    }
+    fprintf(file, "\n");
+  }
+  // One row per global y (and z), one column per global x.
+  size_t field[WALK_DIM];
+  size_t field_cells = 1;
+  fprintf(file, "density");
+  for (int d = WALK_DIM - 1; d >= 0; --d) {
+    field[d] = self->bound * self->blocks[d];
+    field_cells *= field[d];
+    fprintf(file, " %lu", field[d]);
+  }
+  fprintf(file, "\n");
+  for (size_t index = 0; index < field_cells; ++index) {
+    size_t rest = index;
+    size_t rank = 0;
+    size_t cell = 0;
+    size_t rank_stride = 1;
+    size_t cell_stride = 1;
+    for (int d = 0; d < WALK_DIM; ++d) {
+      size_t coordinate = rest % field[d];
+      rest /= field[d];
+      rank += coordinate / self->bound * rank_stride;
+      cell += coordinate % self->bound * cell_stride;
+      rank_stride *= self->blocks[d];
+      cell_stride *= self->bound;
+    }
+    size_t x = index % field[0];
+    fprintf(file, x ? " %lu" : "%lu", all_cells[rank * cells + cell]);
+    if (x == field[0] - 1)
+      fprintf(file, "\n");
+  }
+  fclose(file);
+  free(all_moments);
+  free(all_origins);
+  free(all_cells);
+}
+
+void PrintReport(MessengerThread* self, OutgoingMessage* msg) {
+  RunReport* report = msg->value.report;
+  double seconds = MPI_Wtime() - self->start_time_;
+  double max_seconds;
+  size_t counters[3] = {report->steps, report->migrations,
+                        report->local_migrations};
+  size_t totals[3];
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  long max_rss;
+  MPI_Reduce(&seconds, &max_seconds, 1, MPI_DOUBLE, MPI_MAX, 0,
+             MPI_COMM_WORLD);
+  MPI_Reduce(counters, totals, 3, MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0,
+             MPI_COMM_WORLD);
+  MPI_Reduce(&usage.ru_maxrss, &max_rss, 1, MPI_LONG, MPI_MAX, 0,
+             MPI_COMM_WORLD);
+  if (self->rank != 0)
+    return;
+  printf("report ranks=%d seconds=%.6f steps=%lu migrations=%lu "
+         "local_migrations=%lu max_rss_kb=%ld\n",
+         self->size, max_seconds, totals[0], totals[1], totals[2], max_rss);
+  fflush(stdout);
+}
 
-  MPI_Offset offset = y_pos * self->width * msg->value.dump.length +
-                      x_pos * self->bound * self->size;
-  offset *= inset;
-  printf("%lu\n", msg->value.dump.length);
-  MPI_File_set_view(file, offset, MPI_UNSIGNED_LONG_LONG, MPI_Particle_Vector,
-                    "native", MPI_INFO_NULL);
-  MPI_File_write_all(file, msg->value.dump.counts, msg->value.dump.length,
-                     MPI_UNSIGNED_LONG_LONG, MPI_STATUS_IGNORE);
-  MPI_File_close(&file);
+void PushPendingSend(MessengerThread* self, MPI_Request request, void* buffer) {
+  PendingSend* pending = (PendingSend*)malloc(sizeof(PendingSend));
+  pending->request = request;
+  pending->buffer = buffer;
+  QueuePush(&self->pending_sends_, pending);
+}
+
+// Release the buffers of the sends that completed so far.
+void CompletePendingSends(MessengerThread* self) {
+  size_t pending_count = QueueSize(&self->pending_sends_);
+  for (size_t i = 0; i < pending_count; ++i) {
+    PendingSend* pending = (PendingSend*)QueuePop(&self->pending_sends_);
+    int done = 0;
+    MPI_Test(&pending->request, &done, MPI_STATUS_IGNORE);
+    if (done) {
+      free(pending->buffer);
+      free(pending);
+    } else {
+      QueuePush(&self->pending_sends_, pending);
+    }
+  }
+}
+
+// Post the particle counts for every neighbor together with the
+// global sum of finished particles.
+void ExchangeStart(MessengerThread* self, Exchange* exchange) {
+  assert(!self->exchange_);
+  int neighbor_count = exchange->neighbor_count;
+  self->exchange_ = exchange;
+  self->exchange_requests_ =
+      (MPI_Request*)malloc(sizeof(MPI_Request) * (2 * neighbor_count + 1));
+  self->exchange_request_count_ = 0;
+  self->exchange_stage_ = EXCHANGE_COUNT;
+  for (int i = 0; i < neighbor_count; ++i) {
+    MPI_Irecv(exchange->receive_counts + i, 1, MPI_UNSIGNED_LONG_LONG,
+              exchange->neighbors[i], EXCHANGE_COUNT, MPI_COMM_WORLD,
+              self->exchange_requests_ + self->exchange_request_count_++);
+  }
+  for (int i = 0; i < neighbor_count; ++i) {
+    MPI_Isend(exchange->send_counts + i, 1, MPI_UNSIGNED_LONG_LONG,
+              exchange->neighbors[i], EXCHANGE_COUNT, MPI_COMM_WORLD,
+              self->exchange_requests_ + self->exchange_request_count_++);
+  }
+  MPI_Iallreduce(MPI_IN_PLACE, &exchange->finished, 1, MPI_UNSIGNED_LONG_LONG,
+                 MPI_SUM, MPI_COMM_WORLD,
+                 self->exchange_requests_ + self->exchange_request_count_++);
+}
+
+// Once the counts are known, post the particles themselves; once
+// those arrive, hand the exchange back to the simulation.
+void ExchangeProgress(MessengerThread* self) {
+  Exchange* exchange = self->exchange_;
+  if (!exchange)
+    return;
+  int done = 0;
+  MPI_Testall(self->exchange_request_count_, self->exchange_requests_, &done,
+              MPI_STATUSES_IGNORE);
+  if (!done)
+    return;
+  if (self->exchange_stage_ == EXCHANGE_COUNT) {
+    self->exchange_request_count_ = 0;
+    self->exchange_stage_ = EXCHANGE_DATA;
+    for (int i = 0; i < exchange->neighbor_count; ++i) {
+      if (!exchange->receive_counts[i])
+        continue;
+      exchange->receive[i] =
+          (Particle*)malloc(sizeof(Particle) * exchange->receive_counts[i]);
+      MPI_Irecv(exchange->receive[i], exchange->receive_counts[i],
+                MPI_Particle, exchange->neighbors[i], EXCHANGE_DATA,
+                MPI_COMM_WORLD,
+                self->exchange_requests_ + self->exchange_request_count_++);
+    }
+    for (int i = 0; i < exchange->neighbor_count; ++i) {
+      if (!exchange->send_counts[i])
+        continue;
+      MPI_Isend(exchange->send[i], exchange->send_counts[i], MPI_Particle,
+                exchange->neighbors[i], EXCHANGE_DATA, MPI_COMM_WORLD,
+                self->exchange_requests_ + self->exchange_request_count_++);
+    }
+  } else {
+    free(self->exchange_requests_);
+    self->exchange_ = NULL;
+    ExchangeComplete(exchange);
+  }
 }
 
 void SendMessage(MessengerThread* self, OutgoingMessage* msg) {
@@ -95,56 +494,194 @@ void SendMessage(MessengerThread* self, OutgoingMessage* msg) {
       MPI_Isend(msg->value.particle.particle, 1, MPI_Particle,
                 msg->value.particle.destination, PARTICLE, MPI_COMM_WORLD,
                 &req);
-      free(msg->value.particle.particle);
-      MPI_Request_free(&req);
+      PushPendingSend(self, req, msg->value.particle.particle);
       break;
     }
     case COUNT: {
       for (int i = 0; i < self->size; ++i) {
-        MPI_Isend(&msg->value, 1, MPI_UNSIGNED_LONG_LONG, i, COUNT,
-                  MPI_COMM_WORLD, &req);
-        MPI_Request_free(&req);
+        size_t* count = (size_t*)malloc(sizeof(size_t));
+        *count = msg->value.count;
+        MPI_Isend(count, 1, MPI_UNSIGNED_LONG_LONG, i, COUNT, MPI_COMM_WORLD,
+                  &req);
+        PushPendingSend(self, req, count);
       }
       break;
     }
-    case DUMP: {
-      DumpData(self, msg);
+    case DUMP:
+    case SNAPSHOT: {
+      msg->value.dump.seconds = MPI_Wtime() - self->start_time_;
+      QueuePush(&self->snapshots_, msg);
+      return;
+    }
+    case SUMMARY: {
+      DumpSummary(self, msg);
+      break;
+    }
+    case REPORT: {
+      PrintReport(self, msg);
+      break;
+    }
+    case EXCHANGE: {
+      ExchangeStart(self, msg->value.exchange);
+      break;
+    }
+    default: {
+      assert(0);
     }
   }
 
   free(msg);
 }
 
-void InitMPIStruct(size_t size, size_t bound, size_t width) {
+void InitMPIStruct(MessengerThread* self) {
   {
-    int block_lengths[4] = {1, 1, 1, 1};
-    MPI_Aint offsets[4] = {offsetof(Particle, x), offsetof(Particle, y),
+    int block_lengths[6] = {WALK_DIM, 1, WALK_DIM, WALK_DIM, 1, 1};
+    MPI_Aint offsets[6] = {offsetof(Particle, pos),
                            offsetof(Particle, parent),
+                           offsetof(Particle, start),
+                           offsetof(Particle, winding),
+                           offsetof(Particle, trace),
                            offsetof(Particle, iterations)};
-    MPI_Datatype types[4] = {MPI_INT, MPI_INT, MPI_INT, MPI_UNSIGNED_LONG_LONG};
-    MPI_Type_create_struct(4, block_lengths, offsets, types, &MPI_Particle);
+    MPI_Datatype types[6] = {MPI_INT, MPI_INT, MPI_INT, MPI_INT, MPI_INT,
+                             MPI_UNSIGNED_LONG_LONG};
+    MPI_Type_create_struct(6, block_lengths, offsets, types, &MPI_Particle);
     MPI_Type_commit(&MPI_Particle);
   }
   {
-    MPI_Type_vector(bound, bound * size, width * bound * size,
-                    MPI_UNSIGNED_LONG_LONG, &MPI_Particle_Vector);
-    MPI_Type_commit(&MPI_Particle_Vector);
+    // Written without the padding of the struct.
+    int block_lengths[5] = {1, 1, 1, 1, WALK_DIM};
+    MPI_Aint offsets[5] = {offsetof(TraceEvent, step),
+                           offsetof(TraceEvent, parent),
+                           offsetof(TraceEvent, trace),
+                           offsetof(TraceEvent, rank),
+                           offsetof(TraceEvent, pos)};
+    MPI_Datatype types[5] = {MPI_UNSIGNED_LONG_LONG, MPI_INT, MPI_INT,
+                             MPI_INT, MPI_INT};
+    MPI_Type_create_struct(5, block_lengths, offsets, types,
+                           &MPI_Trace_Event);
+    MPI_Type_commit(&MPI_Trace_Event);
+  }
+  {
+    // The field is stored with the blocks in reverse axis order,
+    // z (or y) slowest, while the cells inside every block keep
+    // the local [x][y]([z]) order. A cell holds a counter per rank.
+    int sizes[WALK_DIM + 1];
+    int subsizes[WALK_DIM + 1];
+    int starts[WALK_DIM + 1];
+    int rest = self->rank;
+    for (int d = 0; d < WALK_DIM; ++d) {
+      int axis = WALK_DIM - 1 - d;
+      sizes[axis] = self->bound * self->blocks[d];
+      subsizes[axis] = self->bound;
+      starts[axis] = rest % self->blocks[d] * self->bound;
+      rest /= self->blocks[d];
+    }
+    sizes[WALK_DIM] = self->size;
+    subsizes[WALK_DIM] = self->size;
+    starts[WALK_DIM] = 0;
+    MPI_Type_create_subarray(WALK_DIM + 1, sizes, subsizes, starts,
+                             MPI_ORDER_C, MPI_UNSIGNED_LONG_LONG,
+                             &MPI_Field_Block);
+    MPI_Type_commit(&MPI_Field_Block);
   }
 }
 
+// Append the recorded trace events to the trace file once the
+// previous append is done. The ranks append independently through
+// the shared file pointer, so their events interleave in chunks.
+void TraceProgress(MessengerThread* self) {
+  if (!self->trace_)
+    return;
+  int done = 0;
+  MPI_Test(&self->trace_request_, &done, MPI_STATUS_IGNORE);
+  if (!done)
+    return;
+  size_t count = TraceBufferDrain(self->trace_, self->trace_flush_,
+                                  TRACE_SLOTS);
+  if (count)
+    MPI_File_iwrite_shared(self->trace_file_, self->trace_flush_, count,
+                           MPI_Trace_Event, &self->trace_request_);
+}
+
+int TraceIdle(MessengerThread* self) {
+  return !self->trace_ || (self->trace_request_ == MPI_REQUEST_NULL &&
+                           TraceBufferEmpty(self->trace_));
+}
+
+// Allocate the mailboxes of this rank in a window shared by the
+// node and find the ones of the other ranks of the node.
+void OpenMailboxes(MessengerThread* self) {
+  int local_rank;
+  int local_size;
+  MPI_Comm_rank(self->node_comm_, &local_rank);
+  MPI_Comm_size(self->node_comm_, &local_size);
+  self->outboxes_ = (Mailbox**)calloc(self->size, sizeof(Mailbox*));
+  self->inboxes_ = NULL;
+  self->inbox_count_ = 0;
+  self->next_inbox_ = 0;
+  self->mailbox_win_ = MPI_WIN_NULL;
+  if (!self->use_mailboxes_ || local_size == 1)
+    return;
+  MPI_Win_allocate_shared(sizeof(Mailbox) * local_size, sizeof(Mailbox),
+                          MPI_INFO_NULL, self->node_comm_, &self->inboxes_,
+                          &self->mailbox_win_);
+  self->inbox_count_ = local_size;
+  for (int i = 0; i < local_size; ++i) {
+    MailboxInit(self->inboxes_ + i);
+  }
+  // Nobody may write into the mailboxes before they are initialized.
+  MPI_Barrier(self->node_comm_);
+
+  MPI_Group world_group;
+  MPI_Group node_group;
+  int local_ranks[local_size];
+  int world_ranks[local_size];
+  MPI_Comm_group(MPI_COMM_WORLD, &world_group);
+  MPI_Comm_group(self->node_comm_, &node_group);
+  for (int i = 0; i < local_size; ++i) {
+    local_ranks[i] = i;
+  }
+  MPI_Group_translate_ranks(node_group, local_size, local_ranks, world_group,
+                            world_ranks);
+  for (int i = 0; i < local_size; ++i) {
+    if (i == local_rank)
+      continue;
+    MPI_Aint size;
+    int disp_unit;
+    Mailbox* peer_inboxes;
+    MPI_Win_shared_query(self->mailbox_win_, i, &size, &disp_unit,
+                         &peer_inboxes);
+    self->outboxes_[world_ranks[i]] = peer_inboxes + local_rank;
+  }
+  MPI_Group_free(&world_group);
+  MPI_Group_free(&node_group);
+}
+
 void* MessengerThreadJob(void* in) {
   MessengerThreadParams* params = (MessengerThreadParams*)in;
   MessengerThread* self = params->self;
   MPI_Comm_rank(MPI_COMM_WORLD, &self->rank);
   MPI_Comm_size(MPI_COMM_WORLD, &self->size);
-  InitMPIStruct(self->size, self->bound, self->width);
-  InitializeStructure(params->master_params);
+  MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, self->rank,
+                      MPI_INFO_NULL, &self->node_comm_);
+  InitMPIStruct(self);
+  OpenOutput(self);
+  OpenMailboxes(self);
+  self->start_time_ = MPI_Wtime();
+  InitializeStructure(self, params->master_params);
   while (!(atomic_load(&self->shutdown_) && QueueEmpty(&self->receive_queue_) &&
-           QueueEmpty(&self->send_queue_))) {
+           QueueEmpty(&self->send_queue_) &&
+           QueueEmpty(&self->pending_sends_) && !self->exchange_ &&
+           QueueEmpty(&self->snapshots_) &&
+           self->snapshot_stage_ == SNAPSHOT_IDLE && TraceIdle(self))) {
     OutgoingMessage* out_msg;
     while ((out_msg = PopMessage(self))) {
       SendMessage(self, out_msg);
     }
+    CompletePendingSends(self);
+    ExchangeProgress(self);
+    SnapshotProgress(self);
+    TraceProgress(self);
     int flag = 0;
     for (int i = 0; i < self->size; ++i) {
       MPI_Iprobe(i, COUNT, MPI_COMM_WORLD, &flag, NULL);
@@ -168,12 +705,24 @@ void* MessengerThreadJob(void* in) {
       }
     }
   }
+  if (self->trace_) {
+    if (self->trace_->dropped)
+      fprintf(stderr, "%d: dropped %lu trace events\n", self->rank,
+              self->trace_->dropped);
+    MPI_File_close(&self->trace_file_);
+  }
+  if (self->mailbox_win_ != MPI_WIN_NULL)
+    MPI_Win_free(&self->mailbox_win_);
+  free(self->outboxes_);
+  MPI_Comm_free(&self->node_comm_);
+  MPI_Comm_free(&self->snapshot_comm_);
   return NULL;
 }
 
 MessengerThread* MessengerThreadCreate(InitialParams* params,
                                        size_t bound,
-                                       size_t width) {
+                                       const size_t* blocks,
+                                       const SimulationOptions* options) {
   MessengerThread* self = (MessengerThread*)malloc(sizeof(MessengerThread));
   MessengerThreadParams* job_params =
       (MessengerThreadParams*)malloc(sizeof(MessengerThreadParams));
@@ -183,12 +732,33 @@ MessengerThread* MessengerThreadCreate(InitialParams* params,
   pthread_mutex_init(&self->receive_queue_mtx_, NULL);
   QueueInit(&self->send_queue_);
   QueueInit(&self->receive_queue_);
+  QueueInit(&self->pending_sends_);
+  QueueInit(&self->snapshots_);
   atomic_init(&self->finished_count_);
   atomic_init(&self->shutdown_);
+  atomic_init(&self->snapshot_busy_);
   atomic_store(&self->finished_count_, 0);
   atomic_store(&self->shutdown_, 0);
+  atomic_store(&self->snapshot_busy_, 0);
+  self->exchange_ = NULL;
+  self->snapshot_ = NULL;
+  self->snapshot_stage_ = SNAPSHOT_IDLE;
+  self->snapshot_frame_ = 0;
+  self->write_snapshots_ = options->snapshot_seconds > 0 && options->dump_field;
+  self->output_dir_ = options->output_dir;
+  self->use_mailboxes_ = options->mailboxes;
+  self->trace_ = NULL;
+  self->trace_flush_ = NULL;
+  if (options->trace_rate > 0) {
+    self->trace_ = (TraceBuffer*)malloc(sizeof(TraceBuffer));
+    TraceBufferInit(self->trace_);
+    self->trace_flush_ =
+        (TraceEvent*)malloc(sizeof(TraceEvent) * TRACE_SLOTS);
+  }
   self->bound = bound;
-  self->width = width;
+  for (int d = 0; d < WALK_DIM; ++d) {
+    self->blocks[d] = blocks[d];
+  }
   pthread_create(&self->thread_, NULL, MessengerThreadJob, job_params);
   return self;
 };
@@ -198,8 +768,16 @@ void MessengerThreadDelete(MessengerThread* self) {
   pthread_mutex_destroy(&self->receive_queue_mtx_);
   atomic_destroy(&self->finished_count_);
   atomic_destroy(&self->shutdown_);
+  atomic_destroy(&self->snapshot_busy_);
   QueueDestroy(&self->receive_queue_);
   QueueDestroy(&self->send_queue_);
+  QueueDestroy(&self->pending_sends_);
+  QueueDestroy(&self->snapshots_);
+  if (self->trace_) {
+    TraceBufferDestroy(self->trace_);
+    free(self->trace_);
+    free(self->trace_flush_);
+  }
   free(self);
 }
 
@@ -215,16 +793,40 @@ size_t MessengerThreadGetFinishedCount(MessengerThread* self) {
   return atomic_exchange(&self->finished_count_, 0);
 }
 
+// Take a particle from the first nonempty mailbox, going round
+// them so that no sender is starved.
+Particle* TakeFromMailboxes(MessengerThread* self) {
+  Particle particle;
+  for (int i = 0; i < self->inbox_count_; ++i) {
+    int inbox = (self->next_inbox_ + i) % self->inbox_count_;
+    if (MailboxTake(self->inboxes_ + inbox, &particle)) {
+      self->next_inbox_ = inbox + 1;
+      Particle* to_return = (Particle*)malloc(sizeof(Particle));
+      *to_return = particle;
+      return to_return;
+    }
+  }
+  return NULL;
+}
+
 Particle* MessengerThreadParticlePop(MessengerThread* self) {
   pthread_mutex_lock(&self->receive_queue_mtx_);
   Particle* to_return = (Particle*)QueuePop(&self->receive_queue_);
   pthread_mutex_unlock(&self->receive_queue_mtx_);
+  if (!to_return)
+    to_return = TakeFromMailboxes(self);
   return to_return;
 }
 
-void MessengerThreadSendParticle(MessengerThread* self,
-                                 Particle* particle,
-                                 int target) {
+int MessengerThreadSendParticle(MessengerThread* self,
+                                Particle* particle,
+                                int target) {
+  // A full mailbox falls back to the MPI path.
+  Mailbox* outbox = self->outboxes_[target];
+  if (outbox && MailboxPut(outbox, particle)) {
+    free(particle);
+    return 1;
+  }
   OutgoingMessage* msg = (OutgoingMessage*)malloc(sizeof(OutgoingMessage));
   msg->type = PARTICLE;
   msg->value.particle.particle = particle;
@@ -232,6 +834,7 @@ void MessengerThreadSendParticle(MessengerThread* self,
   pthread_mutex_lock(&self->send_queue_mtx_);
   QueuePush(&self->send_queue_, msg);
   pthread_mutex_unlock(&self->send_queue_mtx_);
+  return 0;
 }
 
 void MessengerThreadSendStats(MessengerThread* self, size_t delta) {
@@ -253,4 +856,56 @@ void MessengerThreadDumpField(MessengerThread* self,
   pthread_mutex_lock(&self->send_queue_mtx_);
   QueuePush(&self->send_queue_, msg);
   pthread_mutex_unlock(&self->send_queue_mtx_);
+}
+
+void MessengerThreadSnapshot(MessengerThread* self,
+                             size_t* counts,
+                             size_t length) {
+  OutgoingMessage* msg = (OutgoingMessage*)malloc(sizeof(OutgoingMessage));
+  msg->type = SNAPSHOT;
+  msg->value.dump.length = length;
+  msg->value.dump.counts = counts;
+  atomic_store(&self->snapshot_busy_, 1);
+  pthread_mutex_lock(&self->send_queue_mtx_);
+  QueuePush(&self->send_queue_, msg);
+  pthread_mutex_unlock(&self->send_queue_mtx_);
+}
+
+int MessengerThreadSnapshotBusy(MessengerThread* self) {
+  return atomic_load(&self->snapshot_busy_);
+}
+
+void MessengerThreadDumpSummary(MessengerThread* self, Statistics* stats) {
+  OutgoingMessage* msg = (OutgoingMessage*)malloc(sizeof(OutgoingMessage));
+  msg->type = SUMMARY;
+  msg->value.summary = stats;
+  pthread_mutex_lock(&self->send_queue_mtx_);
+  QueuePush(&self->send_queue_, msg);
+  pthread_mutex_unlock(&self->send_queue_mtx_);
+}
+
+void MessengerThreadExchange(MessengerThread* self, Exchange* exchange) {
+  OutgoingMessage* msg = (OutgoingMessage*)malloc(sizeof(OutgoingMessage));
+  msg->type = EXCHANGE;
+  msg->value.exchange = exchange;
+  pthread_mutex_lock(&self->send_queue_mtx_);
+  QueuePush(&self->send_queue_, msg);
+  pthread_mutex_unlock(&self->send_queue_mtx_);
+}
+
+void MessengerThreadReport(MessengerThread* self, RunReport* report) {
+  OutgoingMessage* msg = (OutgoingMessage*)malloc(sizeof(OutgoingMessage));
+  msg->type = REPORT;
+  msg->value.report = report;
+  pthread_mutex_lock(&self->send_queue_mtx_);
+  QueuePush(&self->send_queue_, msg);
+  pthread_mutex_unlock(&self->send_queue_mtx_);
+}
+
+pthread_t MessengerThreadHandle(MessengerThread* self) {
+  return self->thread_;
+}
+
+TraceBuffer* MessengerThreadTrace(MessengerThread* self) {
+  return self->trace_;
 }
\ No newline at end of file
@@ -1,15 +1,22 @@
+#include <pthread.h>
 #include <stddef.h>
 
+#include "exchange.h"
 #include "simulation.h"
+#include "statistics.h"
+#include "trace.h"
 
 struct MessengerThread;
 struct Particle;
 
 typedef struct MessengerThread MessengerThread;
 
+// |blocks| holds the number of blocks along every axis. The thread
+// keeps |options| for the output settings.
 MessengerThread* MessengerThreadCreate(InitialParams* params,
                                        size_t bound,
-                                       size_t width);
+                                       const size_t* blocks,
+                                       const SimulationOptions* options);
 
 void MessengerThreadDelete(MessengerThread* self);
 
@@ -17,20 +24,56 @@ void MessengerThreadShutdown(MessengerThread* self);
 
 void MessengerThreadJoin(MessengerThread*);
 
+// The underlying thread, e.g. to pin it to a CPU.
+pthread_t MessengerThreadHandle(MessengerThread* self);
+
 // Returns how many particles finished on other machines and
 // resets the counter.
 size_t MessengerThreadGetFinishedCount(MessengerThread* self);
 
-// Get a pending particle from the queue. Returns NULL if the
-// queue is empty right now.
+// Get a pending particle from the queue or the mailboxes. Returns
+// NULL if there is none right now.
 Particle* MessengerThreadParticlePop(MessengerThread* self);
 
-void MessengerThreadSendParticle(MessengerThread* self,
-                                 Particle* particle,
-                                 int target);
+// Pass |particle| to |target| and take ownership of it. Returns 1
+// if it went through a shared-memory mailbox, 0 if it was queued
+// for an MPI send.
+int MessengerThreadSendParticle(MessengerThread* self,
+                                Particle* particle,
+                                int target);
 
 void MessengerThreadSendStats(MessengerThread* self, size_t delta);
 
+// Write the final |counts| into data.bin. The write completes in
+// the background, before the thread can be joined. Nothing collective
+// may be queued after it.
 void MessengerThreadDumpField(MessengerThread* self,
                               size_t* counts,
-                              size_t bound);
\ No newline at end of file
+                              size_t length);
+
+// Append |counts| to the snapshot file without waiting for the
+// write. The buffer belongs to the thread until
+// |MessengerThreadSnapshotBusy| returns 0.
+void MessengerThreadSnapshot(MessengerThread* self,
+                             size_t* counts,
+                             size_t length);
+
+int MessengerThreadSnapshotBusy(MessengerThread* self);
+
+// Reduce |stats| of all ranks and write them into a summary
+// file. The caller keeps ownership and must keep them alive
+// until the thread is joined.
+void MessengerThreadDumpSummary(MessengerThread* self, Statistics* stats);
+
+// Start swapping the particles of |exchange| with the neighbors.
+// Wait for it with |ExchangeWait| before touching it again.
+void MessengerThreadExchange(MessengerThread* self, Exchange* exchange);
+
+// Ring for the events of the traced particles, written into
+// trace.bin in the background, or NULL if nothing is traced. Only
+// the compute thread may record into it.
+TraceBuffer* MessengerThreadTrace(MessengerThread* self);
+
+// Reduce |report| over all ranks and print it on rank 0 along
+// with the wall time and peak memory usage.
+void MessengerThreadReport(MessengerThread* self, RunReport* report);
\ No newline at end of file
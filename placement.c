@@ -0,0 +1,179 @@
+#define _GNU_SOURCE
+
+#include "placement.h"
+
+#include <dirent.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static const size_t kHugePageSize = 2 << 20;
+static const int kMaxSiblings = 64;
+
+// Read the CPU list of a topology file such as "0-1" or "0,4" into
+// |cpus|. Returns the number of CPUs read.
+static int ReadCpuList(const char* path, int* cpus, int max_cpus) {
+  FILE* file = fopen(path, "r");
+  if (!file)
+    return 0;
+  int count = 0;
+  int first;
+  while (count < max_cpus && fscanf(file, "%d", &first) == 1) {
+    int last = first;
+    int separator = fgetc(file);
+    if (separator == '-') {
+      if (fscanf(file, "%d", &last) != 1)
+        break;
+      separator = fgetc(file);
+    }
+    for (int cpu = first; cpu <= last && count < max_cpus; ++cpu) {
+      cpus[count++] = cpu;
+    }
+    if (separator != ',')
+      break;
+  }
+  fclose(file);
+  return count;
+}
+
+static int ReadSiblings(int cpu, int* siblings) {
+  char path[128];
+  snprintf(path, sizeof(path),
+           "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+  int count = ReadCpuList(path, siblings, kMaxSiblings);
+  if (!count) {
+    siblings[0] = cpu;
+    count = 1;
+  }
+  return count;
+}
+
+// The first hardware thread of the |core|-th physical core, wrapping
+// around when there are fewer cores.
+static int CoreCpu(int core) {
+  int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int first_threads[cpus];
+  int cores = 0;
+  int siblings[kMaxSiblings];
+  for (int cpu = 0; cpu < cpus; ++cpu) {
+    ReadSiblings(cpu, siblings);
+    if (siblings[0] == cpu)
+      first_threads[cores++] = cpu;
+  }
+  if (!cores)
+    return core % cpus;
+  return first_threads[core % cores];
+}
+
+static int SiblingCpu(int cpu) {
+  int siblings[kMaxSiblings];
+  int count = ReadSiblings(cpu, siblings);
+  for (int i = 0; i < count; ++i) {
+    if (siblings[i] != cpu)
+      return siblings[i];
+  }
+  return cpu;
+}
+
+void PlacementChooseCpus(PinPolicy policy,
+                         int core_offset,
+                         int local_rank,
+                         int* compute_cpu,
+                         int* messenger_cpu) {
+  switch (policy) {
+    case PIN_NONE: {
+      *compute_cpu = -1;
+      *messenger_cpu = -1;
+      break;
+    }
+    case PIN_CORES: {
+      *compute_cpu = CoreCpu(core_offset + 2 * local_rank);
+      *messenger_cpu = CoreCpu(core_offset + 2 * local_rank + 1);
+      break;
+    }
+    case PIN_SMT: {
+      *compute_cpu = CoreCpu(core_offset + local_rank);
+      *messenger_cpu = SiblingCpu(*compute_cpu);
+      break;
+    }
+  }
+}
+
+int PlacementPin(pthread_t thread, int cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(thread, sizeof(set), &set);
+}
+
+int PlacementPinnedCpu(pthread_t thread) {
+  cpu_set_t set;
+  if (pthread_getaffinity_np(thread, sizeof(set), &set) ||
+      CPU_COUNT(&set) != 1)
+    return -1;
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &set))
+      return cpu;
+  }
+  return -1;
+}
+
+int PlacementCpuNode(int cpu) {
+  char path[64];
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+  DIR* dir = opendir(path);
+  if (!dir)
+    return -1;
+  int node = -1;
+  struct dirent* entry;
+  while ((entry = readdir(dir))) {
+    if (sscanf(entry->d_name, "node%d", &node) == 1)
+      break;
+  }
+  closedir(dir);
+  return node;
+}
+
+static size_t MappedSize(size_t bytes, PagePolicy policy) {
+  if (policy == PAGES_DEFAULT)
+    return bytes;
+  return (bytes + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+}
+
+void* PlacementAlloc(size_t bytes, PagePolicy policy) {
+  size_t size = MappedSize(bytes, policy);
+  void* data = MAP_FAILED;
+  if (policy == PAGES_EXPLICIT) {
+    data = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  }
+  if (data == MAP_FAILED) {
+    data = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED)
+      return NULL;
+    if (policy != PAGES_DEFAULT)
+      madvise(data, size, MADV_HUGEPAGE);
+  }
+  // First touch places the pages next to the calling thread.
+  memset(data, 0, bytes);
+  return data;
+}
+
+void PlacementFree(void* data, size_t bytes, PagePolicy policy) {
+  if (data)
+    munmap(data, MappedSize(bytes, policy));
+}
+
+const char* PlacementPageName(PagePolicy policy) {
+  switch (policy) {
+    case PAGES_TRANSPARENT:
+      return "transparent";
+    case PAGES_EXPLICIT:
+      return "explicit";
+    default:
+      return "default";
+  }
+}
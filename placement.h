@@ -0,0 +1,48 @@
+#include <pthread.h>
+#include <stddef.h>
+
+#pragma once
+
+typedef enum {
+  // Leave the threads to the scheduler.
+  PIN_NONE,
+  // Compute and messenger threads on two separate physical cores.
+  PIN_CORES,
+  // Compute thread on a physical core, messenger on its SMT sibling.
+  PIN_SMT
+} PinPolicy;
+
+typedef enum {
+  PAGES_DEFAULT,
+  // Ask for transparent huge pages with madvise.
+  PAGES_TRANSPARENT,
+  // Use the explicit huge page pool, falling back to transparent
+  // huge pages when it is empty.
+  PAGES_EXPLICIT
+} PagePolicy;
+
+// Choose the CPUs for the threads of the |local_rank|-th rank on the
+// node, skipping the first |core_offset| physical cores.
+void PlacementChooseCpus(PinPolicy policy,
+                         int core_offset,
+                         int local_rank,
+                         int* compute_cpu,
+                         int* messenger_cpu);
+
+// Bind |thread| to |cpu|. Returns 0 on success.
+int PlacementPin(pthread_t thread, int cpu);
+
+// The only CPU |thread| may run on, or -1 if it is not pinned.
+int PlacementPinnedCpu(pthread_t thread);
+
+// NUMA node of |cpu|, or -1 if it cannot be told.
+int PlacementCpuNode(int cpu);
+
+// Allocate |bytes| of zeroed memory backed by pages of |policy|.
+// The pages are touched by the calling thread, so they land on the
+// NUMA node it runs on.
+void* PlacementAlloc(size_t bytes, PagePolicy policy);
+
+void PlacementFree(void* data, size_t bytes, PagePolicy policy);
+
+const char* PlacementPageName(PagePolicy policy);
@@ -0,0 +1,125 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "data_file.h"
+
+// Reduce a data.bin without reading it into memory.
+//
+// Usage: reduce [-j threads] [-b] [-f frame] FILE bound BLOCKS... REDUCTION
+//   total             particles per field cell, summed over origins
+//   footprint ORIGIN  particles per field cell from a single origin
+//   blocks            particles per destination block and origin
+//   times TIMES       seconds at which every rank took its part of
+//                     the frame, from the snapshot_times.bin TIMES
+// BLOCKS are the blocks along every axis, width height [depth], as
+// given to the simulation. -f picks a frame of a snapshots.bin. The
+// result is printed as text, one row per line, or as raw counters
+// with -b.
+
+void Usage(const char* name) {
+  fprintf(stderr,
+          "Usage: %s [-j threads] [-b] [-f frame] FILE bound width height "
+          "[depth] "
+          "(total | footprint ORIGIN | blocks | times TIMES)\n",
+          name);
+  exit(2);
+}
+
+void Print(const size_t* values, size_t rows, size_t columns, int binary) {
+  if (binary) {
+    fwrite(values, sizeof(size_t), rows * columns, stdout);
+    return;
+  }
+  for (size_t row = 0; row < rows; ++row) {
+    for (size_t column = 0; column < columns; ++column) {
+      printf(column ? " %lu" : "%lu", values[row * columns + column]);
+    }
+    printf("\n");
+  }
+}
+
+int main(int argc, char* argv[]) {
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int binary = 0;
+  size_t frame = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "j:bf:")) != -1) {
+    if (opt == 'j')
+      threads = atoi(optarg);
+    else if (opt == 'b')
+      binary = 1;
+    else if (opt == 'f')
+      frame = atol(optarg);
+    else
+      Usage(argv[0]);
+  }
+  if (argc - optind < 5)
+    Usage(argv[0]);
+  const char* path = argv[optind++];
+  size_t bound;
+  size_t blocks[DATA_FILE_MAX_DIM];
+  int dims = 0;
+  if (sscanf(argv[optind++], "%lu", &bound) != 1)
+    Usage(argv[0]);
+  while (optind < argc && dims < DATA_FILE_MAX_DIM &&
+         sscanf(argv[optind], "%lu", blocks + dims) == 1) {
+    ++optind;
+    ++dims;
+  }
+  if (dims < 2 || optind == argc)
+    Usage(argv[0]);
+  const char* reduction = argv[optind];
+
+  DataFile file;
+  if (DataFileOpen(&file, path, bound, dims, blocks, frame)) {
+    fprintf(stderr,
+            "Cannot map frame %lu of %s as a %d-dimensional field of %lu "
+            "blocks\n",
+            frame, path, dims, file.ranks);
+    return 1;
+  }
+  size_t columns = DataFileFieldWidth(&file);
+  size_t rows = DataFileFieldCells(&file) / columns;
+  size_t* out;
+  if (!strcmp(reduction, "total")) {
+    out = (size_t*)malloc(sizeof(size_t) * rows * columns);
+    DataFileSumOrigins(&file, out, threads);
+  } else if (!strcmp(reduction, "footprint") && argc - optind == 2) {
+    int origin = atoi(argv[optind + 1]);
+    if (origin < 0 || origin >= file.ranks) {
+      fprintf(stderr, "Origin %d is out of range\n", origin);
+      return 1;
+    }
+    out = (size_t*)malloc(sizeof(size_t) * rows * columns);
+    DataFileFootprint(&file, origin, out, threads);
+  } else if (!strcmp(reduction, "blocks")) {
+    rows = file.ranks;
+    columns = file.ranks;
+    out = (size_t*)malloc(sizeof(size_t) * rows * columns);
+    DataFileBlockTotals(&file, out, threads);
+  } else if (!strcmp(reduction, "times") && argc - optind == 2) {
+    double* seconds = (double*)malloc(sizeof(double) * file.ranks);
+    if (DataFileFrameTimes(&file, argv[optind + 1], frame, seconds)) {
+      fprintf(stderr, "No times of frame %lu in %s\n", frame,
+              argv[optind + 1]);
+      return 1;
+    }
+    for (size_t rank = 0; rank < file.ranks; ++rank) {
+      printf("%lu %.6f\n", rank, seconds[rank]);
+    }
+    free(seconds);
+    DataFileClose(&file);
+    return 0;
+  } else {
+    Usage(argv[0]);
+    return 2;
+  }
+  Print(out, rows, columns, binary);
+  free(out);
+  DataFileClose(&file);
+  return 0;
+}
@@ -1,200 +1,330 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "simulation.h"
 
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
+#include "exchange.h"
 #include "fixed_list.h"
 #include "messenger_thread.h"
+#include "statistics.h"
+#include "trace.h"
+#include "walker.h"
 
 static const int kMaxGraceBound = 10;
 static const int kGraceScaleFactor = 10;
 static const size_t kIterationsPerUpdate = 100;
+static const size_t kMaxStepsPerPass = 32;
+
+void SimulationOptionsInit(SimulationOptions* self) {
+  self->dump_field = 1;
+  self->write_summary = 1;
+  self->lockstep_steps = 0;
+  self->legacy_kernel = 0;
+  self->seed = 1;
+  self->report = 0;
+  self->pin = PIN_NONE;
+  self->core_offset = 0;
+  self->pages = PAGES_DEFAULT;
+  self->snapshot_seconds = 0;
+  self->output_dir = ".";
+  self->mailboxes = 1;
+  self->trace_rate = 0;
+}
 
-Particle* ParticleCreate(int min_x, int min_y, int bound, int rank) {
+Particle* ParticleCreate(const int* min, int bound, int rank) {
   Particle* new = malloc(sizeof(Particle));
-  new->x = min_x + (rand() % bound);
-  new->y = min_y + (rand() % bound);
+  for (int d = 0; d < WALK_DIM; ++d) {
+    new->pos[d] = min[d] + (rand() % bound);
+    new->start[d] = new->pos[d];
+    new->winding[d] = 0;
+  }
   new->parent = rank;
+  new->trace = 0;
   new->iterations = 0;
   return new;
 }
 
-void MoveParticle(Particle* particle,
-                  double p_l,
-                  double p_r,
-                  double p_u,
-                  double p_d) {
+void MoveParticle(Particle* particle, const double* probabilities) {
   ++particle->iterations;
   double rand_num = rand() / (double)RAND_MAX;
-  p_r += p_l;
-  p_u += p_r;
-  p_d += p_u;
-  if (rand_num <= p_l) {
-    --particle->x;
-  } else if (rand_num <= p_r) {
-    ++particle->x;
-  } else if (rand_num <= p_u) {
-    --particle->y;
-  } else {
-    ++particle->y;
+  double cumulative = 0;
+  int direction = 0;
+  while (direction < WALK_DIRECTIONS - 1) {
+    cumulative += probabilities[direction];
+    if (rand_num <= cumulative)
+      break;
+    ++direction;
+  }
+  for (int d = 0; d < WALK_DIM; ++d) {
+    particle->pos[d] += kLatticeOffsets[direction][d];
   }
 }
 
-MessengerThread* CreateMsgThreadAndFillParams(InitialParams* params,
-                                              size_t bound,
-                                              size_t width) {
+MessengerThread* CreateMsgThreadAndFillParams(
+    InitialParams* params,
+    size_t bound,
+    const size_t* blocks,
+    const SimulationOptions* options) {
   pthread_mutex_init(&params->mtx, NULL);
   pthread_cond_init(&params->cond, NULL);
   atomic_init(&params->done);
   atomic_store(&params->done, 0);
   pthread_mutex_lock(&params->mtx);
-  MessengerThread* thread = MessengerThreadCreate(params, bound, width);
+  MessengerThread* thread =
+      MessengerThreadCreate(params, bound, blocks, options);
   while (!atomic_load(&params->done))
     pthread_cond_wait(&params->cond, &params->mtx);
   pthread_mutex_unlock(&params->mtx);
   return thread;
 }
 
-size_t* arr3dget(size_t* arr,
-                 size_t idx1,
-                 size_t idx2,
-                 size_t idx3,
-                 size_t size1,
-                 size_t size2,
-                 size_t size3) {
-  size_t offset = idx1 * size2 * size3 + idx2 * size3 + idx3;
-  if (idx1 >= size1) {
-    printf("idx1: %lu, size1: %lu\n", idx1, size1);
-    assert(idx1 < size1);
+// Everything a rank needs to know about its part of the field.
+typedef struct Simulation {
+  MessengerThread* msg_thread;
+  FixedList* list;
+  FixedListNode* list_pool;
+  size_t* finished_by_rank;
+  // Copy of |finished_by_rank| being written as a snapshot, and
+  // when the next one is due.
+  size_t* snapshot;
+  double snapshot_seconds;
+  double next_snapshot;
+  size_t field_length;
+  PagePolicy pages;
+  Statistics stats;
+  Walker walker;
+  int legacy_kernel;
+  // Events of the traced particles, NULL if none are.
+  TraceBuffer* trace;
+  RunReport report;
+  size_t bound;
+  size_t blocks[WALK_DIM];
+  // Cells of the whole field along every axis.
+  int field[WALK_DIM];
+  size_t ranks;
+  size_t max_iterations;
+  size_t total_particles;
+  double probabilities[WALK_DIRECTIONS];
+  int rank;
+  // Position of the block in the grid of blocks and the cells it
+  // spans, inclusive.
+  int block_pos[WALK_DIM];
+  int min[WALK_DIM];
+  int max[WALK_DIM];
+  int grace_bound;
+} Simulation;
+
+// Rank that owns the block at |block_pos|, x changing fastest.
+int BlockRank(const Simulation* sim, const int* block_pos) {
+  int rank = 0;
+  for (int d = WALK_DIM - 1; d >= 0; --d) {
+    rank = rank * sim->blocks[d] + block_pos[d];
   }
-  if (idx2 >= size2) {
-    printf("idx2: %lu, size2: %lu\n", idx2, size2);
-    assert(idx2 < size2);
+  return rank;
+}
+
+// Pin the threads as |options| ask and tell where they ended up.
+void PlaceThreads(Simulation* sim,
+                  const SimulationOptions* options,
+                  int local_rank) {
+  int compute_cpu;
+  int messenger_cpu;
+  pthread_t messenger = MessengerThreadHandle(sim->msg_thread);
+  PlacementChooseCpus(options->pin, options->core_offset, local_rank,
+                      &compute_cpu, &messenger_cpu);
+  if (compute_cpu >= 0 && PlacementPin(pthread_self(), compute_cpu))
+    printf("%d: cannot pin the compute thread to cpu %d\n", sim->rank,
+           compute_cpu);
+  if (messenger_cpu >= 0 && PlacementPin(messenger, messenger_cpu))
+    printf("%d: cannot pin the messenger thread to cpu %d\n", sim->rank,
+           messenger_cpu);
+  if (options->pin == PIN_NONE && !options->report)
+    return;
+  compute_cpu = PlacementPinnedCpu(pthread_self());
+  messenger_cpu = PlacementPinnedCpu(messenger);
+  printf("placement rank=%d local_rank=%d compute_cpu=%d compute_node=%d "
+         "messenger_cpu=%d messenger_node=%d pages=%s\n",
+         sim->rank, local_rank, compute_cpu, PlacementCpuNode(compute_cpu),
+         messenger_cpu, PlacementCpuNode(messenger_cpu),
+         PlacementPageName(options->pages));
+  fflush(stdout);
+}
+
+// A list that can hold every particle, with its nodes allocated
+// according to the page policy.
+FixedList* CreateList(Simulation* sim, FixedListNode** pool) {
+  *pool = (FixedListNode*)PlacementAlloc(
+      sizeof(FixedListNode) * sim->total_particles, sim->pages);
+  return FixedListCreateInPool(sim->total_particles, *pool);
+}
+
+void DeleteList(Simulation* sim, FixedList* list, FixedListNode* pool) {
+  FixedListDelete(list);
+  PlacementFree(pool, sizeof(FixedListNode) * sim->total_particles,
+                sim->pages);
+}
+
+// Counter of the particles from |origin| that finished at |cell|
+// of the local block, laid out [x][y]([z])[origin] for data.bin.
+size_t* FieldCounter(Simulation* sim, const int* cell, int origin) {
+  size_t index = 0;
+  for (int d = 0; d < WALK_DIM; ++d) {
+    assert(cell[d] >= 0 && cell[d] < sim->bound);
+    index = index * sim->bound + cell[d];
   }
-  if (idx3 >= size3) {
-    printf("idx3: %lu, size3: %lu\n", idx3, size3);
-    assert(idx3 < size3);
+  assert(origin >= 0 && origin < sim->ranks);
+  return sim->finished_by_rank + index * sim->ranks + origin;
+}
+
+// Account for a particle that finished inside the local block.
+void RecordFinished(Simulation* sim, const Particle* particle) {
+  int cell[WALK_DIM];
+  double displacement[WALK_DIM];
+  for (int d = 0; d < WALK_DIM; ++d) {
+    cell[d] = particle->pos[d] - sim->min[d];
+    displacement[d] = particle->pos[d] +
+                      particle->winding[d] * sim->field[d] -
+                      particle->start[d];
   }
-  return arr + offset;
+  if (sim->finished_by_rank)
+    *FieldCounter(sim, cell, particle->parent) += 1;
+  StatisticsRecord(&sim->stats, cell, particle->parent, displacement);
 }
 
-void SimulationRun(size_t bound,
-                   size_t width,
-                   size_t height,
-                   size_t max_iterations,
-                   size_t start_particles,
-                   double p_l,
-                   double p_r,
-                   double p_u,
-                   double p_d) {
-  size_t* finished_by_rank =
-      (size_t*)malloc(sizeof(size_t) * bound * bound * width * height);
-  size_t finished_particles = 0;
-  size_t delta = 0;
-  size_t total_particles = width * height * start_particles;
-  size_t iterations = 0;
-  FixedList* list = FixedListCreate(total_particles);
-  InitialParams mpi_params;
-  MessengerThread* msg_thread =
-      CreateMsgThreadAndFillParams(&mpi_params, bound, width);
-  assert(msg_thread);
-  int grace_bound;
-  const int x_pos = mpi_params.rank % width;
-  const int y_pos = mpi_params.rank / width;
-  const int min_x = x_pos * bound;
-  const int min_y = y_pos * bound;
-  const int max_x = min_x + bound - 1;
-  const int max_y = min_y + bound - 1;
-  if (bound / kGraceScaleFactor < kMaxGraceBound) {
-    grace_bound = bound / kGraceScaleFactor;
-  } else {
-    grace_bound = kMaxGraceBound;
+// Wrap |particle| around the field and return the rank that owns
+// its position.
+int WrapParticle(Simulation* sim, Particle* particle) {
+  int block_pos[WALK_DIM];
+  for (int d = 0; d < WALK_DIM; ++d) {
+    if (particle->pos[d] < 0) {
+      particle->pos[d] += sim->field[d];
+      --particle->winding[d];
+    } else if (particle->pos[d] >= sim->field[d]) {
+      particle->pos[d] -= sim->field[d];
+      ++particle->winding[d];
+    }
+    block_pos[d] = particle->pos[d] / sim->bound;
   }
-  for (int x = 0; x < bound; ++x) {
-    for (int y = 0; y < bound; ++y) {
-      for (size_t i = 0; i < width * height; ++i) {
-        *arr3dget(finished_by_rank, x, y, i, bound, bound, width * height) = 0;
-      }
+  return BlockRank(sim, block_pos);
+}
+
+double Now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// Hand a copy of the histogram to the messenger every
+// |snapshot_seconds|. If the previous one is still being written,
+// try again on the next pass rather than wait.
+void TakeSnapshot(Simulation* sim) {
+  if (!sim->snapshot || Now() < sim->next_snapshot ||
+      MessengerThreadSnapshotBusy(sim->msg_thread))
+    return;
+  sim->next_snapshot = Now() + sim->snapshot_seconds;
+  memcpy(sim->snapshot, sim->finished_by_rank,
+         sizeof(size_t) * sim->field_length);
+  MessengerThreadSnapshot(sim->msg_thread, sim->snapshot, sim->field_length);
+}
+
+// Move a traced |particle| one step at a time, recording each. The
+// walker draws the same bits either way, so tracing does not change
+// the walk.
+void AdvanceTracedParticle(Simulation* sim, Particle* particle, size_t steps) {
+  for (size_t i = 0; i < steps; ++i) {
+    if (sim->legacy_kernel) {
+      MoveParticle(particle, sim->probabilities);
+    } else {
+      WalkerAdvance(&sim->walker, particle, 1);
     }
+    TraceRecord(sim->trace, particle, sim->rank);
   }
-  for (size_t i = 0; i < start_particles; ++i) {
-    FixedListPushFront(list,
-                       ParticleCreate(min_x, min_y, bound, mpi_params.rank));
+}
+
+// Move |particle| by |steps| steps with the selected kernel.
+void AdvanceParticle(Simulation* sim, Particle* particle, size_t steps) {
+  sim->report.steps += steps;
+  if (particle->trace) {
+    AdvanceTracedParticle(sim, particle, steps);
+  } else if (sim->legacy_kernel) {
+    for (size_t i = 0; i < steps; ++i) {
+      MoveParticle(particle, sim->probabilities);
+    }
+  } else {
+    WalkerAdvance(&sim->walker, particle, steps);
+  }
+}
+
+// Returns 1 if |particle| stays within the grace area for the next
+// |steps| steps whatever direction it takes.
+int IsInterior(const Simulation* sim, const Particle* particle, int steps) {
+  int inside = 1;
+  for (int d = 0; d < WALK_DIM; ++d) {
+    inside &= particle->pos[d] - steps >= sim->min[d] - sim->grace_bound &&
+              particle->pos[d] + steps <= sim->max[d] + sim->grace_bound;
+  }
+  return inside;
+}
+
+// How many steps |particle| can take at once so that only the last
+// one may leave the grace area, capped by its remaining iterations.
+size_t SafeSteps(const Simulation* sim, const Particle* particle) {
+  if (sim->legacy_kernel)
+    return 1;
+  int distance = particle->pos[0] - (sim->min[0] - sim->grace_bound);
+  for (int d = 0; d < WALK_DIM; ++d) {
+    int lower = particle->pos[d] - (sim->min[d] - sim->grace_bound);
+    int upper = sim->max[d] + sim->grace_bound - particle->pos[d];
+    if (distance > lower)
+      distance = lower;
+    if (distance > upper)
+      distance = upper;
   }
-  while (finished_particles < total_particles) {
+  size_t steps = distance + 1;
+  if (steps > kMaxStepsPerPass)
+    steps = kMaxStepsPerPass;
+  if (steps > sim->max_iterations - particle->iterations)
+    steps = sim->max_iterations - particle->iterations;
+  return steps;
+}
+
+void RunAsync(Simulation* sim) {
+  const size_t max_iterations = sim->max_iterations;
+  FixedList* list = sim->list;
+  MessengerThread* msg_thread = sim->msg_thread;
+  size_t finished_particles = 0;
+  size_t delta = 0;
+  size_t iterations = 0;
+  while (finished_particles < sim->total_particles) {
     FixedListNode* prev = NULL;
     FixedListNode* cursor = FixedListBegin(list);
     while (cursor) {
       Particle* particle = (Particle*)cursor->data;
-      MoveParticle(particle, p_l, p_r, p_u, p_d);
-      int target_rank = mpi_params.rank;
-      int target_x_pos = x_pos;
-      int target_y_pos = y_pos;
-
-      if (particle->x > max_x + grace_bound || 
-          particle->x < min_x - grace_bound ||
-          particle->y > max_y + grace_bound ||
-          particle->y < min_y - grace_bound ||
+      AdvanceParticle(sim, particle, SafeSteps(sim, particle));
+      int target_rank = sim->rank;
+
+      if (!IsInterior(sim, particle, 0) ||
           particle->iterations == max_iterations) {
-        if (particle->x < 0)
-          particle->x += bound * width;
-        else if (particle->x >= bound * width)
-          particle->x -= bound * width;
-        if (particle->y < 0)
-          particle->y += bound * height;
-        else if (particle->y >= bound * height)
-          particle->y -= bound * height;
-        target_x_pos = particle->x / bound;
-        target_y_pos = particle->y / bound;
+        target_rank = WrapParticle(sim, particle);
       }
 
-      target_rank = width * target_y_pos + target_x_pos;
-
-      if (target_rank != mpi_params.rank) {
-        if (!(particle->x >= target_x_pos * bound)) {
-          printf("%d: particle->x: %d, target_x_pos: %d, particle->iterations: %lu\n", mpi_params.rank, particle->x, target_x_pos, particle->iterations);
-          assert(particle->x >= target_x_pos * bound);
-        }
-        if (!(particle->x <= (target_x_pos + 1) * bound)) {
-          printf("%d: particle->x: %d, target_x_pos: %d, particle->iterations: %lu\n", mpi_params.rank, particle->x, target_x_pos, particle->iterations);
-          assert(particle->x <= (target_x_pos + 1) * bound);
-        }
-        if (!(particle->y >= target_y_pos * bound)) {
-          printf("%d: particle->y: %d, target_y_pos: %d, particle->iterations: %lu\n", mpi_params.rank, particle->y, target_y_pos, particle->iterations);
-          assert(particle->y >= target_y_pos * bound);
-        }
-        if (!(particle->y <= (target_y_pos + 1) * bound)) {
-          printf("%d: particle->y: %d, target_y_pos: %d, particle->iterations: %lu\n", mpi_params.rank, particle->y, target_y_pos, particle->iterations);
-          assert(particle->y <= (target_y_pos + 1) * bound);
-        }
+      if (target_rank != sim->rank) {
         FixedListDeleteElement(list, prev);
-        MessengerThreadSendParticle(msg_thread, particle, target_rank);
+        sim->report.local_migrations +=
+            MessengerThreadSendParticle(msg_thread, particle, target_rank);
+        ++sim->report.migrations;
         if (prev) {
           cursor = prev->next;
         } else {
           cursor = FixedListBegin(list);
         }
       } else if (particle->iterations == max_iterations) {
-        if (!(particle->y - min_y >= 0)) {
-          printf("particle->y - min_y: %d\n", particle->y - min_y);
-        }
-        if (!(particle->x - min_x >= 0)) {
-          printf("particle->x - min_x > 0: %d\n", particle->x - min_x);
-        }
-        if (!(particle->x - min_x < bound)) {
-          printf("particle->x - min_x < bound: %d\n", particle->x - min_x);
-        }
-        if (!(particle->y - min_y < bound)) {
-          printf("particle->y - min_y < bound: %d\n", particle->y - min_y);
-        }
-        assert(particle->y - min_y >= 0);
-        assert(particle->x - min_x >= 0);
-        assert(particle->x - min_x < bound);
-        assert(particle->y - min_y < bound);
-        //printf("A particle died here\n");
-        *arr3dget(finished_by_rank, particle->x - min_x, particle->y - min_y,
-                  particle->parent, bound, bound, width * height) += 1;
+        RecordFinished(sim, particle);
         free(particle);
         cursor->data = NULL;
         FixedListDeleteElement(list, prev);
@@ -216,31 +346,14 @@ void SimulationRun(size_t bound,
         delta = 0;
       }
     }
+    TakeSnapshot(sim);
     ++iterations;
     if (iterations == kIterationsPerUpdate) {
       Particle* particle;
       iterations = 0;
       while ((particle = MessengerThreadParticlePop(msg_thread))) {
         if (particle->iterations == max_iterations) {
-          //printf("Received a dead particle\n");
-          if (!(particle->y - min_y >= 0)) {
-            printf("%d: particle->x: %d, particle->y: %d, min_y: %d\n", mpi_params.rank, particle->x, particle->y, min_y);
-            assert(particle->y - min_y >= 0);
-          }
-          if (!(particle->x - min_x >= 0)) {
-            printf("%d: particle->x: %d, particle->y: %d, min_x: %d\n", mpi_params.rank, particle->x, particle->y, min_x);
-            assert(particle->x - min_x >= 0);
-          }
-          if (!(particle->x - min_x < bound)) {
-            printf("%d: particle->x: %d, particle->y: %d, min_x: %d\n", mpi_params.rank, particle->x, particle->y, min_x);
-            assert(particle->x - min_x < bound);
-          }
-          if (!(particle->y - min_y < bound)) {
-            printf("%d: particle->x: %d, particle->y: %d, min_y: %d\n", mpi_params.rank, particle->x, particle->y, min_y);
-            assert(particle->y - min_y < bound);
-          }
-          *arr3dget(finished_by_rank, particle->x - min_x, particle->y - min_y,
-                    particle->parent, bound, bound, width * height) += 1;
+          RecordFinished(sim, particle);
           ++delta;
           free(particle);
         } else {
@@ -249,14 +362,243 @@ void SimulationRun(size_t bound,
       }
     }
   }
+}
+
+void StepParticle(Simulation* sim, Particle* particle, size_t steps) {
+  if (steps > sim->max_iterations - particle->iterations)
+    steps = sim->max_iterations - particle->iterations;
+  AdvanceParticle(sim, particle, steps);
+}
+
+// Decide what happens to |particle| at the end of a superstep:
+// it either stays on this rank, finishes here, or goes into
+// |outgoing|. Returns 1 if it should stay in the list.
+int SettleParticle(Simulation* sim,
+                   Particle* particle,
+                   Exchange* outgoing,
+                   size_t* delta) {
+  int dead = particle->iterations == sim->max_iterations;
+  if (!dead && IsInterior(sim, particle, 0))
+    return 1;
+  int target_rank = WrapParticle(sim, particle);
+  if (target_rank != sim->rank) {
+    ExchangeAdd(outgoing, target_rank, particle);
+    ++sim->report.migrations;
+    free(particle);
+    return 0;
+  }
+  if (!dead)
+    return 1;
+  RecordFinished(sim, particle);
+  free(particle);
+  ++*delta;
+  return 0;
+}
+
+// Distinct ranks of the blocks around this one, excluding this
+// rank itself. Returns their count.
+int CollectNeighbors(const Simulation* sim, int* neighbors) {
+  int count = 0;
+  for (int around = 0; around <= WALK_NEIGHBORS; ++around) {
+    int block_pos[WALK_DIM];
+    int rest = around;
+    for (int d = 0; d < WALK_DIM; ++d) {
+      block_pos[d] =
+          (sim->block_pos[d] + rest % 3 - 1 + sim->blocks[d]) % sim->blocks[d];
+      rest /= 3;
+    }
+    int rank = BlockRank(sim, block_pos);
+    int seen = rank == sim->rank;
+    for (int i = 0; i < count; ++i) {
+      seen |= neighbors[i] == rank;
+    }
+    if (!seen)
+      neighbors[count++] = rank;
+  }
+  return count;
+}
+
+// Bulk-synchronous mode: every superstep each particle takes
+// |steps| steps and particles that left the grace area are
+// exchanged with the neighbors. Particles that cannot leave it
+// are stepped while the exchange is in flight.
+void RunLockstep(Simulation* sim, size_t steps) {
+  int neighbors[WALK_NEIGHBORS];
+  int neighbor_count = CollectNeighbors(sim, neighbors);
+  Exchange exchanges[2];
+  ExchangeInit(exchanges, neighbors, neighbor_count);
+  ExchangeInit(exchanges + 1, neighbors, neighbor_count);
+  FixedListNode* boundary_pool;
+  FixedList* boundary = CreateList(sim, &boundary_pool);
+  size_t finished_particles = 0;
+  size_t delta = 0;
+  int current = 0;
+  while (finished_particles < sim->total_particles) {
+    Exchange* in_flight = exchanges + current;
+    Exchange* outgoing = exchanges + !current;
+    in_flight->finished = delta;
+    delta = 0;
+    MessengerThreadExchange(sim->msg_thread, in_flight);
+    ExchangeClear(outgoing);
+
+    FixedListNode* prev = NULL;
+    FixedListNode* cursor = FixedListBegin(sim->list);
+    while (cursor) {
+      Particle* particle = (Particle*)cursor->data;
+      int keep = 0;
+      if (IsInterior(sim, particle, steps)) {
+        StepParticle(sim, particle, steps);
+        keep = SettleParticle(sim, particle, outgoing, &delta);
+      } else {
+        FixedListPushFront(boundary, particle);
+      }
+      if (keep) {
+        prev = cursor;
+        cursor = prev->next;
+      } else {
+        FixedListDeleteElement(sim->list, prev);
+        cursor = prev ? prev->next : FixedListBegin(sim->list);
+      }
+    }
+
+    ExchangeWait(in_flight);
+    finished_particles += in_flight->finished;
+    for (int i = 0; i < neighbor_count; ++i) {
+      for (size_t j = 0; j < in_flight->receive_counts[i]; ++j) {
+        Particle* particle = (Particle*)malloc(sizeof(Particle));
+        *particle = in_flight->receive[i][j];
+        if (particle->iterations == sim->max_iterations) {
+          RecordFinished(sim, particle);
+          free(particle);
+          ++delta;
+        } else {
+          FixedListPushFront(boundary, particle);
+        }
+      }
+    }
+
+    while (FixedListSize(boundary)) {
+      Particle* particle = (Particle*)FixedListBegin(boundary)->data;
+      FixedListDeleteElement(boundary, NULL);
+      StepParticle(sim, particle, steps);
+      if (SettleParticle(sim, particle, outgoing, &delta))
+        FixedListPushFront(sim->list, particle);
+    }
+    TakeSnapshot(sim);
+    current = !current;
+  }
+  ExchangeDestroy(exchanges);
+  ExchangeDestroy(exchanges + 1);
+  DeleteList(sim, boundary, boundary_pool);
+}
+
+void SimulationRun(size_t bound,
+                   const size_t* blocks,
+                   size_t max_iterations,
+                   size_t start_particles,
+                   const double* probabilities,
+                   const SimulationOptions* options) {
+  Simulation sim;
+  InitialParams mpi_params;
+  sim.msg_thread = CreateMsgThreadAndFillParams(&mpi_params, bound, blocks,
+                                               options);
+  assert(sim.msg_thread);
+  sim.rank = mpi_params.rank;
+  // Pin the threads before allocating anything large, so that the
+  // first touch puts the pages next to the compute thread.
+  PlaceThreads(&sim, options, mpi_params.local_rank);
+  sim.pages = options->pages;
+  sim.bound = bound;
+  sim.ranks = 1;
+  for (int d = 0; d < WALK_DIM; ++d) {
+    sim.blocks[d] = blocks[d];
+    sim.field[d] = bound * blocks[d];
+    sim.ranks *= blocks[d];
+  }
+  sim.field_length = sim.ranks;
+  for (int d = 0; d < WALK_DIM; ++d) {
+    sim.field_length *= bound;
+  }
+  sim.finished_by_rank = NULL;
+  sim.snapshot = NULL;
+  sim.snapshot_seconds = options->snapshot_seconds;
+  sim.next_snapshot = Now() + sim.snapshot_seconds;
+  if (options->dump_field) {
+    sim.finished_by_rank = (size_t*)PlacementAlloc(
+        sizeof(size_t) * sim.field_length, sim.pages);
+    if (sim.snapshot_seconds > 0) {
+      sim.snapshot = (size_t*)PlacementAlloc(
+          sizeof(size_t) * sim.field_length, sim.pages);
+    }
+  }
+  StatisticsInit(&sim.stats, bound, sim.ranks);
+  sim.max_iterations = max_iterations;
+  sim.total_particles = sim.ranks * start_particles;
+  for (int i = 0; i < WALK_DIRECTIONS; ++i) {
+    sim.probabilities[i] = probabilities[i];
+  }
+  sim.legacy_kernel = options->legacy_kernel;
+  sim.trace = MessengerThreadTrace(sim.msg_thread);
+  sim.report.steps = 0;
+  sim.report.migrations = 0;
+  sim.report.local_migrations = 0;
+  sim.list_pool = NULL;
+  sim.list = CreateList(&sim, &sim.list_pool);
+  WalkerInit(&sim.walker, probabilities,
+             ((uint64_t)options->seed << 32) | sim.rank);
+  // The start positions and the legacy kernel draw from rand().
+  srand(options->seed);
+  int rest = sim.rank;
+  for (int d = 0; d < WALK_DIM; ++d) {
+    sim.block_pos[d] = rest % blocks[d];
+    rest /= blocks[d];
+    sim.min[d] = sim.block_pos[d] * bound;
+    sim.max[d] = sim.min[d] + bound - 1;
+  }
+  if (bound / kGraceScaleFactor < kMaxGraceBound) {
+    sim.grace_bound = bound / kGraceScaleFactor;
+  } else {
+    sim.grace_bound = kMaxGraceBound;
+  }
+  for (size_t i = 0; i < start_particles; ++i) {
+    Particle* particle = ParticleCreate(sim.min, bound, sim.rank);
+    if (sim.trace &&
+        TraceSampled(options->trace_rate, options->seed, sim.rank, i)) {
+      particle->trace = i + 1;
+      TraceRecord(sim.trace, particle, sim.rank);
+    }
+    FixedListPushFront(sim.list, particle);
+  }
+  if (options->lockstep_steps) {
+    // A particle must not get past the neighboring blocks within
+    // a single superstep.
+    size_t steps = options->lockstep_steps;
+    if (steps > bound - sim.grace_bound)
+      steps = bound - sim.grace_bound;
+    RunLockstep(&sim, steps);
+  } else {
+    RunAsync(&sim);
+  }
   pthread_cond_destroy(&mpi_params.cond);
   pthread_mutex_destroy(&mpi_params.mtx);
   atomic_destroy(&mpi_params.done);
-  MessengerThreadDumpField(msg_thread, finished_by_rank,
-                           bound * bound * width * height);
-  MessengerThreadShutdown(msg_thread);
-  MessengerThreadJoin(msg_thread);
-  MessengerThreadDelete(msg_thread);
-  free(finished_by_rank);
-  FixedListDelete(list);
+  if (options->report) {
+    MessengerThreadReport(sim.msg_thread, &sim.report);
+  }
+  if (options->write_summary) {
+    MessengerThreadDumpSummary(sim.msg_thread, &sim.stats);
+  }
+  // Last, so that the write overlaps the shutdown of the thread.
+  if (sim.finished_by_rank) {
+    MessengerThreadDumpField(sim.msg_thread, sim.finished_by_rank,
+                             sim.field_length);
+  }
+  MessengerThreadShutdown(sim.msg_thread);
+  MessengerThreadJoin(sim.msg_thread);
+  MessengerThreadDelete(sim.msg_thread);
+  StatisticsDestroy(&sim.stats);
+  PlacementFree(sim.finished_by_rank, sizeof(size_t) * sim.field_length,
+                sim.pages);
+  PlacementFree(sim.snapshot, sizeof(size_t) * sim.field_length, sim.pages);
+  DeleteList(&sim, sim.list, sim.list_pool);
 }
\ No newline at end of file
@@ -2,29 +2,83 @@
 #include <stddef.h>
 
 #include "atomic.h"
+#include "lattice.h"
+#include "placement.h"
 
 #pragma once
 
 typedef struct Particle {
-  int x;
-  int y;
+  int pos[WALK_DIM];
   int parent;
+  // Where the particle was created and how many times it
+  // wrapped around the field, to restore its full displacement.
+  int start[WALK_DIM];
+  int winding[WALK_DIM];
+  // Position of the particle among the ones created by |parent|,
+  // counting from 1, if its steps are traced, otherwise 0.
+  int trace;
   size_t iterations;
 } Particle;
 
+typedef struct SimulationOptions {
+  // Write the full per-origin histogram into data.bin.
+  int dump_field;
+  // Write the in-situ statistics into summary.txt.
+  int write_summary;
+  // Run in lockstep, exchanging particles every that many steps.
+  // Zero keeps the asynchronous mode.
+  size_t lockstep_steps;
+  // Step with the original one-rand()-per-step kernel.
+  int legacy_kernel;
+  // Seed of rand() and of the stepping kernel, which mixes it with
+  // the rank.
+  unsigned seed;
+  // Print the run time and counters reduced over all ranks.
+  int report;
+  // Where to run the compute and messenger threads.
+  PinPolicy pin;
+  // Physical cores to skip before the first pinned thread.
+  int core_offset;
+  // Pages backing the histogram and the particle list.
+  PagePolicy pages;
+  // Append a copy of the histogram to snapshots.bin every that many
+  // seconds. Zero disables the snapshots, as does |dump_field|.
+  double snapshot_seconds;
+  // Directory for data.bin, snapshots.bin and summary.txt.
+  const char* output_dir;
+  // Pass the particles between ranks of the same node through
+  // shared memory rather than MPI messages, in the async mode.
+  int mailboxes;
+  // Fraction of the particles whose every step is written into
+  // trace.bin.
+  double trace_rate;
+} SimulationOptions;
+
+// Counters of a single rank, see |SimulationOptions::report|.
+typedef struct RunReport {
+  size_t steps;
+  size_t migrations;
+  // Migrations that went through a shared-memory mailbox.
+  size_t local_migrations;
+} RunReport;
+
+void SimulationOptionsInit(SimulationOptions* self);
+
 typedef struct InitialParams {
   atomic_size_t done;
   pthread_mutex_t mtx;
   pthread_cond_t cond;
   int rank;
+  // Rank among the ones running on the same node.
+  int local_rank;
 } InitialParams;
 
-void SimulationRun(size_t l,
-                   size_t a,
-                   size_t b,
-                   size_t n,
-                   size_t N,
-                   double p_l,
-                   double p_r,
-                   double p_u,
-                   double p_d);
\ No newline at end of file
+// Walk on a field of |blocks| blocks of |bound| cells along every
+// axis, one block per rank. Every direction of |kLatticeOffsets| is
+// taken with the matching weight of |probabilities|.
+void SimulationRun(size_t bound,
+                   const size_t* blocks,
+                   size_t max_iterations,
+                   size_t start_particles,
+                   const double* probabilities,
+                   const SimulationOptions* options);
\ No newline at end of file
@@ -0,0 +1,96 @@
+#include "statistics.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+static size_t CellCount(size_t bound) {
+  size_t count = 1;
+  for (int d = 0; d < WALK_DIM; ++d) {
+    count *= bound;
+  }
+  return count;
+}
+
+void StatisticsInit(Statistics* self, size_t bound, size_t ranks) {
+  self->cells = (size_t*)calloc(CellCount(bound), sizeof(size_t));
+  self->origins = (size_t*)calloc(ranks, sizeof(size_t));
+  self->bound = bound;
+  self->ranks = ranks;
+  MomentsInit(&self->displacement);
+}
+
+void StatisticsDestroy(Statistics* self) {
+  free(self->cells);
+  free(self->origins);
+}
+
+void StatisticsRecord(Statistics* self,
+                      const int* cell,
+                      int origin,
+                      const double* displacement) {
+  size_t index = 0;
+  for (int d = WALK_DIM - 1; d >= 0; --d) {
+    assert(cell[d] >= 0 && cell[d] < self->bound);
+    index = index * self->bound + cell[d];
+  }
+  assert(origin >= 0 && origin < self->ranks);
+  ++self->cells[index];
+  ++self->origins[origin];
+  MomentsAdd(&self->displacement, displacement);
+}
+
+void MomentsInit(Moments* self) {
+  self->count = 0;
+  for (int i = 0; i < WALK_DIM; ++i) {
+    self->mean[i] = 0;
+    for (int j = 0; j < WALK_DIM; ++j) {
+      self->comoment[i][j] = 0;
+    }
+  }
+  self->mean_r2 = 0;
+}
+
+void MomentsAdd(Moments* self, const double* displacement) {
+  self->count += 1;
+  double delta[WALK_DIM];
+  double r2 = 0;
+  for (int i = 0; i < WALK_DIM; ++i) {
+    delta[i] = displacement[i] - self->mean[i];
+    self->mean[i] += delta[i] / self->count;
+  }
+  for (int i = 0; i < WALK_DIM; ++i) {
+    for (int j = i; j < WALK_DIM; ++j) {
+      self->comoment[i][j] += delta[i] * (displacement[j] - self->mean[j]);
+    }
+    r2 += displacement[i] * displacement[i];
+  }
+  self->mean_r2 += (r2 - self->mean_r2) / self->count;
+}
+
+void MomentsMerge(Moments* self, const Moments* other) {
+  if (other->count == 0)
+    return;
+  double count = self->count + other->count;
+  double delta[WALK_DIM];
+  double weight = self->count * other->count / count;
+  for (int i = 0; i < WALK_DIM; ++i) {
+    delta[i] = other->mean[i] - self->mean[i];
+  }
+  for (int i = 0; i < WALK_DIM; ++i) {
+    for (int j = i; j < WALK_DIM; ++j) {
+      self->comoment[i][j] +=
+          other->comoment[i][j] + delta[i] * delta[j] * weight;
+    }
+  }
+  for (int i = 0; i < WALK_DIM; ++i) {
+    self->mean[i] += delta[i] * other->count / count;
+  }
+  self->mean_r2 += (other->mean_r2 - self->mean_r2) * other->count / count;
+  self->count = count;
+}
+
+double MomentsCovariance(const Moments* self, int i, int j) {
+  if (i > j)
+    return MomentsCovariance(self, j, i);
+  return self->count > 1 ? self->comoment[i][j] / (self->count - 1) : 0;
+}
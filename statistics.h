@@ -0,0 +1,53 @@
+#include <stddef.h>
+
+#include "lattice.h"
+
+#pragma once
+
+// Running moments of the particle displacement, updated one
+// sample at a time with Welford's method.
+typedef struct Moments {
+  double count;
+  double mean[WALK_DIM];
+  // Sums of the products of the deviations along every pair of
+  // axes, only the upper triangle with the diagonal is used.
+  double comoment[WALK_DIM][WALK_DIM];
+  double mean_r2;
+} Moments;
+
+// Number of doubles in |Moments|, used to ship it over MPI.
+#define MOMENTS_FIELDS (2 + WALK_DIM + WALK_DIM * WALK_DIM)
+
+// In-situ statistics of the particles that finished on this rank.
+typedef struct Statistics {
+  // Final positions inside the local block, with x changing fastest.
+  size_t* cells;
+  // How many finished particles came from every origin rank.
+  size_t* origins;
+  Moments displacement;
+  size_t bound;
+  size_t ranks;
+} Statistics;
+
+void StatisticsInit(Statistics* self, size_t bound, size_t ranks);
+
+void StatisticsDestroy(Statistics* self);
+
+// Account for a particle that finished at |cell| of the local block,
+// came from |origin| and travelled |displacement| in total.
+void StatisticsRecord(Statistics* self,
+                      const int* cell,
+                      int origin,
+                      const double* displacement);
+
+void MomentsInit(Moments* self);
+
+void MomentsAdd(Moments* self, const double* displacement);
+
+// Combine two sets of moments as if all samples of |other| were
+// added to |self|.
+void MomentsMerge(Moments* self, const Moments* other);
+
+// Sample covariance of the displacement along axes |i| and |j|,
+// the variance if they are the same.
+double MomentsCovariance(const Moments* self, int i, int j);
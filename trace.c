@@ -0,0 +1,59 @@
+#include "trace.h"
+
+#include <stdlib.h>
+
+#include "walker.h"
+
+void TraceBufferInit(TraceBuffer* self) {
+  self->head = 0;
+  self->tail = 0;
+  self->dropped = 0;
+  self->slots = (TraceEvent*)malloc(sizeof(TraceEvent) * TRACE_SLOTS);
+}
+
+void TraceBufferDestroy(TraceBuffer* self) {
+  free(self->slots);
+}
+
+void TraceRecord(TraceBuffer* self, const Particle* particle, int rank) {
+  size_t tail = self->tail;
+  if (tail - __atomic_load_n(&self->head, __ATOMIC_ACQUIRE) == TRACE_SLOTS) {
+    ++self->dropped;
+    return;
+  }
+  TraceEvent* event = self->slots + tail % TRACE_SLOTS;
+  event->step = particle->iterations;
+  event->parent = particle->parent;
+  event->trace = particle->trace;
+  event->rank = rank;
+  for (int d = 0; d < WALK_DIM; ++d) {
+    event->pos[d] = particle->pos[d];
+  }
+  __atomic_store_n(&self->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+size_t TraceBufferDrain(TraceBuffer* self, TraceEvent* events,
+                        size_t max_events) {
+  size_t head = self->head;
+  size_t count = __atomic_load_n(&self->tail, __ATOMIC_ACQUIRE) - head;
+  if (count > max_events)
+    count = max_events;
+  for (size_t i = 0; i < count; ++i) {
+    events[i] = self->slots[(head + i) % TRACE_SLOTS];
+  }
+  __atomic_store_n(&self->head, head + count, __ATOMIC_RELEASE);
+  return count;
+}
+
+int TraceBufferEmpty(TraceBuffer* self) {
+  return self->head == __atomic_load_n(&self->tail, __ATOMIC_ACQUIRE);
+}
+
+int TraceSampled(double rate, unsigned seed, int rank, size_t index) {
+  if (rate <= 0)
+    return 0;
+  uint64_t key =
+      WalkerMix(((uint64_t)seed << 32 | (uint32_t)rank) ^ WalkerMix(index));
+  // Compare the top 53 bits as a fraction in [0, 1).
+  return (key >> 11) * (1.0 / (1ULL << 53)) < rate;
+}
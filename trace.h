@@ -0,0 +1,58 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "simulation.h"
+
+#pragma once
+
+#define TRACE_SLOTS (1 << 16)
+#define TRACE_LINE 64
+
+// Where a traced particle was after a step. A particle is told
+// apart by |parent| and |trace|, see |Particle::trace|. The trace
+// file holds the events packed one after the other in native byte
+// order: |step| as 8 bytes, then every other field as 4 bytes.
+typedef struct TraceEvent {
+  size_t step;
+  int parent;
+  int trace;
+  // Rank that made the step.
+  int rank;
+  // Before wrapping around the field, so it may lie just outside.
+  int pos[WALK_DIM];
+} TraceEvent;
+
+// Ring of events from the compute thread, which records them, to
+// the messenger thread, which writes them out. Like a |Mailbox| it
+// has a single producer and a single consumer and needs no locks.
+// The compute thread never waits for room: when the ring is full
+// the event is dropped and counted.
+typedef struct TraceBuffer {
+  // Next slot to read, only written by the consumer.
+  size_t head;
+  char head_padding[TRACE_LINE - sizeof(size_t)];
+  // Next slot to write, only written by the producer.
+  size_t tail;
+  size_t dropped;
+  char tail_padding[TRACE_LINE - 2 * sizeof(size_t)];
+  TraceEvent* slots;
+} TraceBuffer;
+
+void TraceBufferInit(TraceBuffer* self);
+
+void TraceBufferDestroy(TraceBuffer* self);
+
+// Record where |particle| is now as seen by |rank|.
+void TraceRecord(TraceBuffer* self, const Particle* particle, int rank);
+
+// Move up to |max_events| of the oldest events into |events|.
+// Returns how many were moved.
+size_t TraceBufferDrain(TraceBuffer* self, TraceEvent* events,
+                        size_t max_events);
+
+int TraceBufferEmpty(TraceBuffer* self);
+
+// Returns 1 if the |index|-th particle created by |rank| is in a
+// sample of |rate| of all particles. The choice depends on |seed|
+// but not on any random stream of the walk.
+int TraceSampled(double rate, unsigned seed, int rank, size_t index);
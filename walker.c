@@ -0,0 +1,109 @@
+#include "walker.h"
+
+// With a power of two directions a uniform step is the plain bits,
+// otherwise a 16-bit chunk split into equal spans, one per direction.
+// The chunks past the last whole span would favour the first
+// directions, they are skipped and the step is drawn again.
+static const unsigned kUniformBits =
+    WALK_DIRECTIONS == 4 ? 2 : WALK_DIRECTIONS == 8 ? 3 : 16;
+#define UNIFORM_SPAN ((1u << kUniformBits) / WALK_DIRECTIONS)
+#define UNIFORM_LIMIT (UNIFORM_SPAN * WALK_DIRECTIONS)
+// Rounding the thresholds to 32 bits shifts every probability by
+// less than 2^-33, so even very unlikely directions are taken.
+static const unsigned kGeneralBits = 32;
+
+uint64_t WalkerMix(uint64_t z) {
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+// splitmix64, every bit of the output is usable.
+static uint64_t WalkerNextWord(Walker* self) {
+  self->state += 0x9E3779B97F4A7C15ULL;
+  return WalkerMix(self->state);
+}
+
+void WalkerInit(Walker* self, const double* probabilities, uint64_t seed) {
+  double total = 0;
+  for (int i = 0; i < WALK_DIRECTIONS; ++i) {
+    total += probabilities[i];
+  }
+  double cumulative = 0;
+  self->uniform = 1;
+  for (int i = 0; i < WALK_DIRECTIONS; ++i) {
+    double deviation = probabilities[i] / total - 1.0 / WALK_DIRECTIONS;
+    if (deviation > 1e-9 || deviation < -1e-9)
+      self->uniform = 0;
+  }
+  for (int i = 0; i < WALK_DIRECTIONS - 1; ++i) {
+    cumulative += probabilities[i] / total;
+    self->thresholds[i] =
+        (uint64_t)(cumulative * (double)(1ULL << kGeneralBits) + 0.5);
+  }
+  // Scramble the seed so that close seeds give unrelated streams.
+  self->state = WalkerMix(seed);
+  self->word = 0;
+  self->bits_left = 0;
+}
+
+void WalkerAdvance(Walker* self, Particle* particle, size_t steps) {
+  const unsigned bits = self->uniform ? kUniformBits : kGeneralBits;
+  const uint64_t mask = (1ULL << bits) - 1;
+  uint64_t thresholds[WALK_DIRECTIONS - 1];
+  int pos[WALK_DIM];
+  for (int i = 0; i < WALK_DIRECTIONS - 1; ++i) {
+    thresholds[i] = self->thresholds[i];
+  }
+  for (int d = 0; d < WALK_DIM; ++d) {
+    pos[d] = particle->pos[d];
+  }
+  uint64_t word = self->word;
+  unsigned bits_left = self->bits_left;
+  particle->iterations += steps;
+  while (steps) {
+    if (bits_left < bits) {
+      word = WalkerNextWord(self);
+      bits_left = 64;
+    }
+    size_t chunks = bits_left / bits;
+    size_t used = 0;
+    size_t taken = 0;
+    if (self->uniform) {
+      // Without a power of two directions some chunks give no step,
+      // so go chunk by chunk rather than step by step.
+      for (; used < chunks && taken < steps; ++used) {
+        uint32_t value = word & mask;
+        word >>= kUniformBits;
+        if (value >= UNIFORM_LIMIT)
+          continue;
+        unsigned direction = value / UNIFORM_SPAN;
+        for (int d = 0; d < WALK_DIM; ++d) {
+          pos[d] += kLatticeOffsets[direction][d];
+        }
+        ++taken;
+      }
+    } else {
+      taken = chunks < steps ? chunks : steps;
+      used = taken;
+      for (size_t i = 0; i < taken; ++i) {
+        uint32_t value = word & mask;
+        unsigned direction = 0;
+        for (int j = 0; j < WALK_DIRECTIONS - 1; ++j) {
+          direction += value >= thresholds[j];
+        }
+        word >>= kGeneralBits;
+        for (int d = 0; d < WALK_DIM; ++d) {
+          pos[d] += kLatticeOffsets[direction][d];
+        }
+      }
+    }
+    bits_left -= used * bits;
+    steps -= taken;
+  }
+  for (int d = 0; d < WALK_DIM; ++d) {
+    particle->pos[d] = pos[d];
+  }
+  self->word = word;
+  self->bits_left = bits_left;
+}
@@ -0,0 +1,32 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lattice.h"
+#include "simulation.h"
+
+#pragma once
+
+// Stepping kernel that decodes several steps from every 64-bit
+// random word. With equal probabilities a step takes as few bits
+// as tell the directions apart, otherwise 32 bits compared against
+// precomputed thresholds.
+typedef struct Walker {
+  uint64_t state;
+  uint64_t word;
+  unsigned bits_left;
+  int uniform;
+  // Cumulative probabilities of all directions but the last,
+  // scaled to 32 bits. A cumulative probability of 1 is 2^32, which
+  // no value reaches.
+  uint64_t thresholds[WALK_DIRECTIONS - 1];
+} Walker;
+
+// splitmix64 finalizer: every bit of the result depends on every bit
+// of |z|.
+uint64_t WalkerMix(uint64_t z);
+
+// |probabilities| holds a weight per direction of |kLatticeOffsets|.
+void WalkerInit(Walker* self, const double* probabilities, uint64_t seed);
+
+// Move |particle| by |steps| steps.
+void WalkerAdvance(Walker* self, Particle* particle, size_t steps);